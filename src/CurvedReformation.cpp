@@ -1,10 +1,72 @@
 // std libs
 #include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <numeric>
 #include <time.h>
 
+// memory mapped files, process memory
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#endif
+
+// simd intrinsics, the kernels are compiled for each instruction set and picked at runtime
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CMPR_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CMPR_TARGET(isa)
+#else
+#define CMPR_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+#ifdef _MSC_VER
+#define CMPR_NOINLINE __declspec(noinline)
+#else
+#define CMPR_NOINLINE __attribute__((noinline))
+#endif
+
 // pybind lib
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
+#include <pybind11/functional.h>
+
+namespace py = pybind11;
 
 // vtk stuff
 #include <vtkSmartPointer.h>
@@ -20,13 +82,13 @@
 #include <vtkArrayData.h>
 #include <vtkPointData.h>
 #include <vtkDoubleArray.h>
+#include <vtkDataArray.h>
+#include <vtkFieldData.h>
+#include <vtk_zlib.h>
 #include <vtkPlaneSource.h>
 #include <vtkTransform.h>
 #include <vtkTransformPolyDataFilter.h>
 #include <vtkAppendPolyData.h>
-#include <vtkSmoothPolyDataFilter.h>
-#include <vtkTriangleFilter.h>
-// #include <vtkvmtkPolyDataKiteRemovalFilter.h>
 #include <vtkSmartPointer.h>
 #include <vtkPoints.h>
 #include <vtkCellArray.h>
@@ -46,50 +108,218 @@
 
 // ==== DECLARATONS  ====
 
-std::map<std::string, std::vector<float>> compute_cmpr_stretch(std::string volumeFileName,
-                                                               std::vector<float> seeds,
-                                                               unsigned int resolution,
-                                                               std::vector<int> dir,
-                                                               std::vector<float> stack_direction,
-                                                               float dist_slices,
-                                                               int n_slices,
-                                                               bool render);
-std::map<std::string, std::vector<float>> compute_cmpr_straight(std::string volumeFileName,
-                                                                std::vector<float> seeds,
-                                                                std::vector<float> tng,
-                                                                std::vector<float> ptn,
-                                                                unsigned int resolution,
-                                                                std::vector<int> dir,
-                                                                std::vector<float> stack_direction,
-                                                                float slice_dimension,
-                                                                float dist_slices,
-                                                                int n_slices,
-                                                                bool render);
+struct CmprOptions;
+struct CmprViewport;
+struct CmprResult;
+struct ImplicitStack;
+struct AxialFrames;
+struct PixelBuffer;
+struct PixelStats;
+enum SlabMode : int;
+struct NrrdHeader;
+struct GzipMember;
+struct BenchmarkTimings;
+struct StageTiming;
+struct CenterlineSpec;
+struct PeakMemoryTracking;
+class CmprMapping;
+class CancelToken;
+class MappedFile;
+
+// Gives the volume to sample once the world bounds of the samples are known
+typedef std::function<vtkSmartPointer<vtkImageData>(const double bounds[6])> VolumeLoader;
+
+CmprResult compute_cmpr_stretch(std::string volumeFileName,
+                                std::vector<float> seeds,
+                                unsigned int resolution,
+                                std::vector<int> dir,
+                                std::vector<float> stack_direction,
+                                float dist_slices,
+                                int n_slices,
+                                bool render,
+                                const CmprOptions &options);
+CmprResult compute_cmpr_straight(std::string volumeFileName,
+                                 std::vector<float> seeds,
+                                 std::vector<float> tng,
+                                 std::vector<float> ptn,
+                                 unsigned int resolution,
+                                 std::vector<int> dir,
+                                 std::vector<float> stack_direction,
+                                 float slice_dimension,
+                                 float dist_slices,
+                                 int n_slices,
+                                 bool render,
+                                 const CmprOptions &options);
+CmprResult ComputeCmprStraight(const VolumeLoader &load,
+                               const std::vector<float> &metadata,
+                               const double *scalar_range,
+                               std::vector<float> seeds,
+                               std::vector<float> tng,
+                               std::vector<float> ptn,
+                               unsigned int resolution,
+                               std::vector<int> dir,
+                               std::vector<float> stack_direction,
+                               float slice_dimension,
+                               float dist_slices,
+                               int n_slices,
+                               bool render,
+                               const CmprOptions &options);
+float GetStretchDistance(const std::vector<float> &metadata, const double direction[3]);
+CmprResult ComputeCmprStretch(const VolumeLoader &load,
+                              const std::vector<float> &metadata,
+                              const double *scalar_range,
+                              std::vector<float> seeds,
+                              unsigned int resolution,
+                              std::vector<int> dir,
+                              std::vector<float> stack_direction,
+                              float dist_slices,
+                              int n_slices,
+                              bool render,
+                              const CmprOptions &options);
+CmprResult ComputeCmprRotational(const VolumeLoader &load,
+                                 const std::vector<float> &metadata,
+                                 const double *scalar_range,
+                                 std::vector<float> seeds,
+                                 std::vector<float> tng,
+                                 std::vector<float> ptn,
+                                 unsigned int resolution,
+                                 std::vector<int> dir,
+                                 float slice_dimension,
+                                 int n_angles,
+                                 const CmprOptions &options);
+int GetPixelType(const CmprOptions &options, vtkImageData *image);
 std::vector<float> GetMetadata(vtkImageData *image);
+void GetBoundsExtent(vtkImageData *image, const double bounds[6], int margin, int extent[6]);
+void GetBoundsScalarRange(vtkImageData *image, const double bounds[6], int n_threads, double range[2]);
 std::map<int, vtkSmartPointer<vtkPolyData>> CreateStack(vtkPolyData *master_slice, int n_slices, std::vector<float> direction, float dist_slices);
-std::map<int, vtkSmartPointer<vtkPolyData>> CreateAxialStack(vtkPolyData *spline, float side_length, int resolution, std::vector<float> &iop_axial, std::vector<float> &ipp_axial);
+std::vector<double> GetStackOffsets(int n_slices, std::vector<float> direction, float dist_slices);
+std::vector<double> GetSlabOffsets(int n_samples, const std::vector<float> &direction, float thickness);
+ImplicitStack CreateSlab(vtkPolyData *master_slice, const std::vector<float> &direction, float thickness, int n_samples);
+ImplicitStack CreateImplicitStack(vtkPolyData *master_slice, int n_slices, std::vector<float> direction, float dist_slices);
+AxialFrames CreateAxialFrames(vtkPolyData *spline, float side_length, int resolution);
+void GetAxialIOPIPP(const AxialFrames &frames, std::vector<float> &iop_axial, std::vector<float> &ipp_axial);
+vtkSmartPointer<vtkPolyData> AxialFramesToPolyData(const AxialFrames &frames);
+void GetSampleBounds(const ImplicitStack &stack, const AxialFrames &frames, double bounds[6]);
+vtkSmartPointer<vtkImageData> CreateSyntheticVolume(const int dims[3], double spacing, int scalar_type, int n_threads);
+std::vector<float> CreateSyntheticCenterline(vtkImageData *image, bool tortuous, int n_points);
+std::vector<float> GetSyntheticNormals(const std::vector<float> &seeds);
+BenchmarkTimings RunBenchmarkCase(vtkImageData *image, const std::vector<float> &seeds, int resolution, int n_slices,
+                                  int repeats, int n_threads);
+void WriteBenchmarkRecord(std::ostream &out, bool csv, bool first, const std::string &volume, const std::string &type,
+                          const std::string &centerline, const std::string &stage, const std::vector<double> &ms);
+int RunBenchmark(int argc, char *argv[]);
+std::atomic<int> &GetVerbosityLevel();
+void SetVerbosity(int level);
+bool ResetPeakMemory();
+PeakMemoryTracking &GetPeakMemoryTracking();
+void GetProcessMemory(double &rss_mb, double &peak_rss_mb);
+void WriteChromeTrace(const std::string &path, const std::vector<StageTiming> &stages);
+std::mutex &GetProbeMutex();
+double GetSpecSize(const CenterlineSpec &spec);
+std::vector<CmprResult> ComputeCmprStraightBatch(vtkImageData *image,
+                                                 const std::vector<float> &metadata,
+                                                 const double scalar_range[2],
+                                                 const std::vector<CenterlineSpec> &specs,
+                                                 const CmprOptions &options);
 vtkSmartPointer<vtkPolyData> Squash(std::map<int, vtkSmartPointer<vtkPolyData>> stack_map, bool reverse);
-std::vector<float> GetPixelValues(vtkDataSet *dataset, bool reverse);
-std::vector<float> GetDimensions(std::map<int, vtkSmartPointer<vtkPolyData>> stack);
-float GetWindowWidth(vtkSmartPointer<vtkImageData> image, float max, float min);
+PixelBuffer GetPixelValues(vtkDataSet *dataset, int type, bool reverse, PixelStats *stats);
+PixelStats GetPixelStats(const PixelBuffer &values, const double scalar_range[2]);
+std::vector<float> GetWindowLevel(const PixelStats &stats, const double scalar_range[2], float percentile);
 vtkSmartPointer<vtkPolyData> GetPlanar(vtkDataArray *pixels, vtkPolyData *spline);
 int renderAll(vtkPolyData *spline, vtkProbeFilter *sampleVolume, vtkImageData *image, int resolution, float range);
 vtkSmartPointer<vtkPolyData> CreateSpline(std::vector<float> seeds, int resolution, double origin[3], double normal[3], bool project);
+vtkSmartPointer<vtkPolyData> SweepSurface(vtkPolyData *line, const std::vector<double> &smoothed, double distance, int cols);
 vtkSmartPointer<vtkPolyData> SweepLine(vtkPolyData *line, std::vector<float> directions, double distance, int cols);
+vtkSmartPointer<vtkPolyData> CreateGridSurface(vtkPoints *points, unsigned int rows, unsigned int cols);
+CmprViewport ResolveViewport(const CmprViewport &viewport, int rows, int cols, int n_images);
+vtkSmartPointer<vtkPolyData> SweepViewport(vtkPolyData *line, const std::vector<double> &directions, double distance, int cols,
+                                           const CmprViewport &view);
+void GetLineTangent(vtkPolyData *line, vtkIdType i, double tangent[3]);
+std::vector<double> SmoothSweepDirections(vtkPolyData *line, const std::vector<float> &directions, unsigned int rows, int radius);
+int CountFolds(vtkPolyData *line, const std::vector<double> &directions, unsigned int rows, double half_width);
+std::vector<double> GetSweepDirections(vtkPolyData *line, const std::vector<float> &directions, double distance);
+void SweepRows(vtkPolyData *line, const std::vector<double> &directions, double distance, int cols,
+               unsigned int row_begin, unsigned int row_end, float *points);
 vtkSmartPointer<vtkPolyData> ShiftMasterSlice(vtkPolyData *original_surface, int index, std::vector<float> dir);
-void GetIOPIPP(vtkSmartPointer<vtkPlaneSource> slice, double iop[6], double ipp[3]);
-vtkSmartPointer<vtkPolyData> GetOrientedPlane(double origin[3], double normal[3], float side_length, int resolution, std::vector<float> &iop_axial, std::vector<float> &ipp_axial);
+void RotateVector(double v[3], const double axis[3], double theta);
+std::vector<double> RotateSweepDirections(vtkPolyData *line, const std::vector<double> &directions, const std::vector<double> &angles);
+void SetPlaneNormal(double v1[3], double v2[3], double normal[3], const double new_normal[3]);
+void GetAxialBasis(const double center[3], const double normal[3], float side_length, double ipp[3], double u[3], double v[3]);
 double GetMeanDistanceBtwPoints(vtkSmartPointer<vtkPolyData> spline);
+PixelBuffer SampleImage(vtkImageData *image, vtkPoints *points, int type, bool reverse, vtkIdType block, int n_threads, PixelStats *stats);
+void ParallelFor(int n_items, int n_threads, std::function<void(int)> body);
+int GetHardwareThreads();
+void GetBrickAddresses(const int dims[3], std::vector<vtkIdType> address[3]);
+void BrickImage(vtkImageData *image, int n_threads);
+int DetectSimdLevel();
+int GetSimdLevel();
+PixelBuffer SampleStack(vtkImageData *image, const ImplicitStack &stack, int type, int n_threads, PixelStats *stats);
+void SampleStackRange(vtkImageData *image, const float *points, vtkIdType n, vtkIdType begin, vtkIdType end,
+                      const std::vector<double> &offsets, PixelBuffer &out, int n_threads);
+PixelBuffer SampleRotational(vtkImageData *image, vtkPolyData *spline, const std::vector<double> &directions,
+                             double distance, int cols, int type, int n_threads, PixelStats *stats);
+PixelBuffer SampleSlab(vtkImageData *image, const ImplicitStack &slab, SlabMode mode, int type, int n_threads, PixelStats *stats);
+PixelBuffer SampleAxialFrames(vtkImageData *image, const AxialFrames &frames, int first, int last, int type, bool reverse, int n_threads, PixelStats *stats);
+vtkSmartPointer<vtkProbeFilter> ProbeImage(vtkImageData *image, vtkPolyData *surface);
+vtkSmartPointer<vtkImageData> DownsampleImage(vtkImageData *image, int n_threads);
+std::vector<vtkSmartPointer<vtkImageData>> CreatePyramid(vtkImageData *image, int n_threads);
+int GetPyramidLevel(const std::vector<vtkSmartPointer<vtkImageData>> &pyramid, double output_spacing);
+int GetNrrdScalarType(std::string type);
+std::vector<double> GetNrrdNumbers(const std::string &value);
+NrrdHeader ReadNrrdHeader(const std::string &path);
+std::string GetNrrdDataPath(const std::string &path, const std::string &data_file);
+bool IsNrrdGzip(const NrrdHeader &header);
+std::string GetNrrdDataIssue(const NrrdHeader &header);
+vtkSmartPointer<vtkImageData> ReadNrrdInformation(const std::string &path);
+bool InflateGzipExtent(const NrrdHeader &header, const int extent[6], const unsigned char *data, size_t size,
+                       unsigned char *out, int n_threads);
+vtkSmartPointer<vtkImageData> ReadNrrd(const std::string &path, std::shared_ptr<MappedFile> &mapping, int n_threads,
+                                       const int *extent);
+void CompressNrrd(const std::string &input, const std::string &output, int level, int n_threads);
+unsigned int GetLittleEndian32(const unsigned char *bytes);
+void SetLittleEndian32(unsigned char *bytes, unsigned int value);
+std::vector<GzipMember> GetGzipMembers(const unsigned char *data, size_t size);
+bool InflateGzipStream(const unsigned char *data, size_t size, unsigned char *out, size_t out_size);
+bool InflateGzipChunks(const unsigned char *data, size_t size, size_t out_size,
+                       const std::function<void(size_t, const unsigned char *, size_t)> &sink);
+bool InflateGzip(const unsigned char *data, size_t size, unsigned char *out, size_t out_size, int n_threads);
+std::vector<unsigned char> DeflateGzipMember(const unsigned char *data, size_t size, int level);
+void DeflateGzipMembers(std::ostream &stream, const unsigned char *data, size_t size, int level, int n_threads);
 
 // custom libs
 
+#include "options.h"
+#include "cancel.h"
+#include "trace.h"
+#include "response.h"
 #include "geometry.h"
 #ifdef DYNAMIC_VMTK
 #include "render.h"
 #endif
 #include "stack.h"
+#include "parallel.h"
+// every level of the kernels rounds alike only without fused multiply-adds, as the build sets (-ffp-contract=off)
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+#include "kernel.h"
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+#include "sampler.h"
+#include "pyramid.h"
+#include "mapping.h"
+#include "gzip.h"
+#include "nrrd.h"
 #include "cmpr.h"
+#include "batch.h"
+#include "volume.h"
+#include "centerline.h"
 #include "test.h"
+#include "benchmark.h"
 
 // TODO
 // - project spline on volume bound plane using extrusion direction negated DONE
@@ -101,6 +331,12 @@ double GetMeanDistanceBtwPoints(vtkSmartPointer<vtkPolyData> spline);
 // - return stack dimensions DONE
 // - return the list of the keys present in the response, in order to avoid python remaining stuck trying to read something that doesn't exist
 
+#ifdef CMPR_BENCHMARK
+int main(int argc, char *argv[])
+{
+  return RunBenchmark(argc, argv);
+}
+#else
 int main(int argc, char *argv[])
 {
   // TODO get input from argv:
@@ -140,10 +376,330 @@ int main(int argc, char *argv[])
 
   return 0;
 }
+#endif
+
+// Hand a buffer over to numpy: the array takes ownership of the memory, no copy is made
+template <class T>
+py::array ToNumpy(std::vector<T> &&values, std::vector<size_t> shape)
+{
+  std::vector<T> *buffer = new std::vector<T>(std::move(values));
+  py::capsule owner(buffer, [](void *p) { delete reinterpret_cast<std::vector<T> *>(p); });
+
+  return py::array_t<T>(shape, buffer->data(), owner);
+}
+
+template <class T>
+py::array ToNumpyTyped(PixelBuffer &&pixels, std::vector<size_t> shape)
+{
+  PixelBuffer *buffer = new PixelBuffer(std::move(pixels));
+  py::capsule owner(buffer, [](void *p) { delete reinterpret_cast<PixelBuffer *>(p); });
+
+  return py::array_t<T>(shape, buffer->GetPointer<T>(), owner);
+}
+
+// Pixels keep their scalar type as numpy dtype
+py::array ToNumpy(PixelBuffer &&pixels, std::vector<size_t> shape)
+{
+  switch (pixels.type)
+  {
+    vtkTemplateMacro(return ToNumpyTyped<VTK_TT>(std::move(pixels), shape));
+  }
+
+  throw std::invalid_argument("unsupported pixel type " + std::to_string(pixels.type));
+}
+
+// Shape a stack as (slices, rows, cols) from its [rows, cols, slices] dimensions
+std::vector<size_t> GetStackShape(const std::vector<float> &dimension, size_t size)
+{
+  std::vector<size_t> shape = {
+      size_t(dimension[2]),
+      size_t(dimension[0]),
+      size_t(dimension[1])};
+
+  // keep the flat layout if dimensions do not describe the buffer
+  if (shape[0] * shape[1] * shape[2] != size)
+  {
+    return {size};
+  }
+
+  return shape;
+}
+
+py::dict ToPython(CmprResult &&result)
+{
+  py::dict response;
+
+  std::vector<size_t> shape_cmpr = GetStackShape(result.fields["dimension_cmpr"], result.pixels_cmpr.size);
+  std::vector<size_t> shape_axial = GetStackShape(result.fields["dimension_axial"], result.pixels_axial.size);
+  response["pixels_cmpr"] = ToNumpy(std::move(result.pixels_cmpr), shape_cmpr);
+  response["pixels_axial"] = ToNumpy(std::move(result.pixels_axial), shape_axial);
+
+  for (auto &field : result.fields)
+  {
+    size_t size = field.second.size();
+    response[field.first.c_str()] = ToNumpy(std::move(field.second), {size});
+  }
+
+  // stage -> {start_us, duration_us, rss_mb, peak_rss_mb, stage_peak}, in stage order
+  py::dict timings;
+  for (const StageTiming &timing : result.timings)
+  {
+    py::dict stage;
+    stage["start_us"] = timing.start_us;
+    stage["duration_us"] = timing.duration_us;
+    stage["rss_mb"] = timing.rss_mb;
+    stage["peak_rss_mb"] = timing.peak_rss_mb;
+    stage["stage_peak"] = timing.stage_peak;
+    timings[timing.stage.c_str()] = stage;
+  }
+  response["timings"] = timings;
+
+  if (result.mapping)
+  {
+    response["mapping"] = py::cast(result.mapping);
+  }
+
+  return response;
+}
+
+// Points as a (n, 3) array of doubles, mapped by one of the CmprMapping functions
+typedef py::array_t<double, py::array::c_style | py::array::forcecast> PointArray;
+
+py::array MapPoints(const PointArray &points, const std::function<std::vector<double>(const double *, size_t)> &map)
+{
+  size_t n = size_t(points.size()) / 3;
+  return ToNumpy(map(points.data(), n), {n, 3});
+}
+
+// CmprResult is returned to python as a dict of numpy arrays, plus the dict of stage timings
+namespace pybind11
+{
+namespace detail
+{
+template <>
+struct type_caster<CmprResult>
+{
+  PYBIND11_TYPE_CASTER(CmprResult, _("Dict[str, Union[numpy.ndarray, dict, Mapping]]"));
+
+  bool load(handle, bool)
+  {
+    return false;
+  }
+
+  static handle cast(CmprResult src, return_value_policy, handle)
+  {
+    return ToPython(std::move(src)).release();
+  }
+};
+} // namespace detail
+} // namespace pybind11
+
+// Runs a call that releases the GIL on the executor of the module, returns its concurrent.futures.Future
+// (await it with asyncio.wrap_future). The executor is created on first use, python joins it at exit.
+py::object SubmitAsync(py::object function, py::args args, py::kwargs kwargs)
+{
+  py::module module = py::module::import("pyCmpr");
+  if (!py::hasattr(module, "_executor"))
+  {
+    module.attr("_executor") = py::module::import("concurrent.futures").attr("ThreadPoolExecutor")(py::arg("thread_name_prefix") = "cmpr");
+  }
+  return module.attr("_executor").attr("submit")(function, *args, **kwargs);
+}
 
 // define a module to be imported by python
 PYBIND11_MODULE(pyCmpr, m)
 {
-  m.def("compute_cmpr_straight", &compute_cmpr_straight, "", "");
-  m.def("compute_cmpr_stretch", &compute_cmpr_stretch, "", "");
+  // a cancelled request raises cmpr.Cancelled, also a concurrent.futures.CancelledError
+  py::register_exception<CmprCancelled>(m, "Cancelled", py::module::import("concurrent.futures").attr("CancelledError"));
+
+  py::class_<CancelToken, std::shared_ptr<CancelToken>>(m, "CancelToken")
+      .def(py::init<>())
+      .def("cancel", &CancelToken::Cancel, "stop the requests of this token at their next stage or block of samples")
+      .def_property_readonly("cancelled", &CancelToken::IsCancelled);
+
+  py::enum_<SamplerType>(m, "Sampler")
+      .value("PROBE", SAMPLER_PROBE)
+      .value("TRILINEAR", SAMPLER_TRILINEAR);
+
+  py::enum_<PixelType>(m, "PixelType")
+      .value("NATIVE", PIXEL_NATIVE)
+      .value("INT8", PIXEL_INT8)
+      .value("UINT8", PIXEL_UINT8)
+      .value("INT16", PIXEL_INT16)
+      .value("UINT16", PIXEL_UINT16)
+      .value("INT32", PIXEL_INT32)
+      .value("UINT32", PIXEL_UINT32)
+      .value("FLOAT32", PIXEL_FLOAT32)
+      .value("FLOAT64", PIXEL_FLOAT64);
+
+  py::enum_<SlabMode>(m, "Slab")
+      .value("NONE", SLAB_NONE)
+      .value("MIP", SLAB_MIP)
+      .value("MINIP", SLAB_MINIP)
+      .value("MEAN", SLAB_MEAN);
+
+  py::class_<CmprViewport>(m, "Viewport")
+      .def(py::init<>())
+      .def_readwrite("row_begin", &CmprViewport::row_begin)
+      .def_readwrite("row_end", &CmprViewport::row_end)
+      .def_readwrite("col_begin", &CmprViewport::col_begin)
+      .def_readwrite("col_end", &CmprViewport::col_end)
+      .def_readwrite("slice_begin", &CmprViewport::slice_begin)
+      .def_readwrite("slice_end", &CmprViewport::slice_end)
+      .def_readwrite("out_rows", &CmprViewport::out_rows)
+      .def_readwrite("out_cols", &CmprViewport::out_cols);
+
+  py::class_<CmprOptions>(m, "Options")
+      .def(py::init<>())
+      .def_readwrite("sampler", &CmprOptions::sampler)
+      .def_readwrite("threads", &CmprOptions::threads)
+      .def_readwrite("pixel_type", &CmprOptions::pixel_type)
+      .def_readwrite("load_roi", &CmprOptions::load_roi)
+      .def_readwrite("trace_file", &CmprOptions::trace_file)
+      .def_readwrite("wwwl_percentile", &CmprOptions::wwwl_percentile)
+      .def_readwrite("on_preview", &CmprOptions::on_preview)
+      .def_readwrite("preview_resolution", &CmprOptions::preview_resolution)
+      .def_readwrite("slab", &CmprOptions::slab)
+      .def_readwrite("slab_thickness", &CmprOptions::slab_thickness)
+      .def_readwrite("slab_samples", &CmprOptions::slab_samples)
+      .def_readwrite("cancel", &CmprOptions::cancel)
+      .def_readwrite("viewport", &CmprOptions::viewport);
+
+
+  py::class_<CenterlineSpec>(m, "CenterlineSpec")
+      .def(py::init<>())
+      .def_readwrite("seeds", &CenterlineSpec::seeds)
+      .def_readwrite("tng", &CenterlineSpec::tng)
+      .def_readwrite("ptn", &CenterlineSpec::ptn)
+      .def_readwrite("resolution", &CenterlineSpec::resolution)
+      .def_readwrite("dir", &CenterlineSpec::dir)
+      .def_readwrite("stack_direction", &CenterlineSpec::stack_direction)
+      .def_readwrite("slice_dimension", &CenterlineSpec::slice_dimension)
+      .def_readwrite("dist_slices", &CenterlineSpec::dist_slices)
+      .def_readwrite("n_slices", &CenterlineSpec::n_slices);
+
+  m.def("set_verbosity", &SetVerbosity, "0: warnings only (default), 1: progress, 2: details of every stage",
+        py::arg("level"));
+
+  m.def("compute_cmpr_straight", &compute_cmpr_straight, "",
+        py::arg("volumeFileName"), py::arg("seeds"), py::arg("tng"), py::arg("ptn"), py::arg("resolution"), py::arg("dir"),
+        py::arg("stack_direction"), py::arg("slice_dimension"), py::arg("dist_slices"), py::arg("n_slices"), py::arg("render"),
+        py::arg("options") = CmprOptions(),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("compute_cmpr_stretch", &compute_cmpr_stretch, "",
+        py::arg("volumeFileName"), py::arg("seeds"), py::arg("resolution"), py::arg("dir"),
+        py::arg("stack_direction"), py::arg("dist_slices"), py::arg("n_slices"), py::arg("render"),
+        py::arg("options") = CmprOptions(),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("compute_cmpr_rotational", &compute_cmpr_rotational, "straightened cmpr from n_angles view angles over [0, 180) degrees",
+        py::arg("volumeFileName"), py::arg("seeds"), py::arg("tng"), py::arg("ptn"), py::arg("resolution"), py::arg("dir"),
+        py::arg("slice_dimension"), py::arg("n_angles"), py::arg("options") = CmprOptions(),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("compute_cmpr_straight_batch", &compute_cmpr_straight_batch, "one straightened cmpr per centerline, volume read once",
+        py::arg("volumeFileName"), py::arg("specs"), py::arg("options") = CmprOptions(),
+        py::call_guard<py::gil_scoped_release>());
+
+  // same arguments, return a concurrent.futures.Future of the result
+  m.def("compute_cmpr_straight_async", [](py::args args, py::kwargs kwargs) {
+    return SubmitAsync(py::module::import("pyCmpr").attr("compute_cmpr_straight"), args, kwargs);
+  });
+  m.def("compute_cmpr_stretch_async", [](py::args args, py::kwargs kwargs) {
+    return SubmitAsync(py::module::import("pyCmpr").attr("compute_cmpr_stretch"), args, kwargs);
+  });
+  m.def("compute_cmpr_rotational_async", [](py::args args, py::kwargs kwargs) {
+    return SubmitAsync(py::module::import("pyCmpr").attr("compute_cmpr_rotational"), args, kwargs);
+  });
+  m.def("compute_cmpr_straight_batch_async", [](py::args args, py::kwargs kwargs) {
+    return SubmitAsync(py::module::import("pyCmpr").attr("compute_cmpr_straight_batch"), args, kwargs);
+  });
+  m.def("compress_nrrd", &CompressNrrd, "rewrite a nrrd volume as gzip members inflated in parallel when loaded",
+        py::arg("input"), py::arg("output"), py::arg("level") = 6, py::arg("threads") = 0);
+
+  py::class_<CmprMapping, std::shared_ptr<CmprMapping>>(m, "Mapping")
+      .def("cmpr_to_world", [](const CmprMapping &mapping, const PointArray &points) {
+        return MapPoints(points, [&](const double *p, size_t n) { return mapping.CmprToWorld(p, n); });
+      },
+           "(n, 3) [image, row, col] of pixels_cmpr -> (n, 3) world points", py::arg("points"))
+      .def("world_to_cmpr", [](const CmprMapping &mapping, const PointArray &points) {
+        return MapPoints(points, [&](const double *p, size_t n) { return mapping.WorldToCmpr(p, n); });
+      },
+           "(n, 3) world points -> (n, 3) [image, row, col] of pixels_cmpr", py::arg("points"))
+      .def("axial_to_world", [](const CmprMapping &mapping, const PointArray &points) {
+        return MapPoints(points, [&](const double *p, size_t n) { return mapping.AxialToWorld(p, n); });
+      },
+           "(n, 3) [frame, row, col] of pixels_axial -> (n, 3) world points", py::arg("points"))
+      .def("world_to_axial", [](const CmprMapping &mapping, const PointArray &points) {
+        return MapPoints(points, [&](const double *p, size_t n) { return mapping.WorldToAxial(p, n); });
+      },
+           "(n, 3) world points -> (n, 3) [frame, row, col] of pixels_axial", py::arg("points"));
+
+  py::class_<Volume, std::shared_ptr<Volume>>(m, "Volume")
+      .def(py::init<std::string, bool, bool>(), py::arg("volumeFileName"), py::arg("bricked") = false, py::arg("pyramid") = false)
+      .def("straight", &Volume::straight,
+           py::arg("seeds"), py::arg("tng"), py::arg("ptn"), py::arg("resolution"), py::arg("dir"),
+           py::arg("stack_direction"), py::arg("slice_dimension"), py::arg("dist_slices"), py::arg("n_slices"), py::arg("render"),
+           py::arg("options") = CmprOptions(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("stretch", &Volume::stretch,
+           py::arg("seeds"), py::arg("resolution"), py::arg("dir"),
+           py::arg("stack_direction"), py::arg("dist_slices"), py::arg("n_slices"), py::arg("render"),
+           py::arg("options") = CmprOptions(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("rotational", &Volume::rotational,
+           py::arg("seeds"), py::arg("tng"), py::arg("ptn"), py::arg("resolution"), py::arg("dir"),
+           py::arg("slice_dimension"), py::arg("n_angles"), py::arg("options") = CmprOptions(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("straight_batch", &Volume::straight_batch, py::arg("specs"), py::arg("options") = CmprOptions(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("straight_async", [](py::object volume, py::args args, py::kwargs kwargs) {
+        return SubmitAsync(volume.attr("straight"), args, kwargs);
+      })
+      .def("stretch_async", [](py::object volume, py::args args, py::kwargs kwargs) {
+        return SubmitAsync(volume.attr("stretch"), args, kwargs);
+      })
+      .def("rotational_async", [](py::object volume, py::args args, py::kwargs kwargs) {
+        return SubmitAsync(volume.attr("rotational"), args, kwargs);
+      })
+      .def("straight_batch_async", [](py::object volume, py::args args, py::kwargs kwargs) {
+        return SubmitAsync(volume.attr("straight_batch"), args, kwargs);
+      })
+      .def_readonly("metadata", &Volume::metadata);
+
+  py::class_<Centerline>(m, "Centerline")
+      .def(py::init<std::shared_ptr<Volume>, std::vector<float>, unsigned int, float, CmprOptions>(),
+           py::arg("volume"), py::arg("seeds"), py::arg("resolution"), py::arg("side_length") = 120.0f,
+           py::arg("options") = CmprOptions())
+      .def("axial_slice", [](Centerline &centerline, int k) {
+        size_t side = 0;
+        PixelBuffer values;
+        {
+          py::gil_scoped_release release;
+          values = centerline.axial(k, k + 1, side);
+        }
+        return ToNumpy(std::move(values), {side, side});
+      },
+           py::arg("k"))
+      .def("axial_slices", [](Centerline &centerline, int k0, int k1) {
+        size_t side = 0;
+        PixelBuffer values;
+        {
+          py::gil_scoped_release release;
+          values = centerline.axial(k0, k1, side);
+        }
+        return ToNumpy(std::move(values), {size_t(k1 - k0), side, side});
+      },
+           py::arg("k0"), py::arg("k1"))
+      .def("straight", &Centerline::straight,
+           py::arg("seeds"), py::arg("tng"), py::arg("ptn"),
+           py::arg("stack_direction"), py::arg("slice_dimension"), py::arg("dist_slices"), py::arg("n_slices"),
+           py::arg("cancel") = std::shared_ptr<CancelToken>(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("straight_async", [](py::object centerline, py::args args, py::kwargs kwargs) {
+        return SubmitAsync(centerline.attr("straight"), args, kwargs);
+      })
+      // an edit running on another thread holds the session: these wait for it, then copy
+      .def_property_readonly("n_frames", &Centerline::GetNumberOfFrames, py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("spacing_axial", &Centerline::GetAxialSpacing, py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("iop_axial", &Centerline::GetIOPAxial, py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("ipp_axial", &Centerline::GetIPPAxial, py::call_guard<py::gil_scoped_release>());
 }
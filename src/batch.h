@@ -0,0 +1,93 @@
+// One centerline of a batch, same parameters as compute_cmpr_straight
+struct CenterlineSpec
+{
+  std::vector<float> seeds;
+  std::vector<float> tng;
+  std::vector<float> ptn;
+  unsigned int resolution = 0;
+  std::vector<int> dir = {0, 0, 1};
+  std::vector<float> stack_direction = {0.0f, 0.0f, 1.0f};
+  float slice_dimension = 0.0f;
+  float dist_slices = 1.0f;
+  int n_slices = 1;
+};
+
+// Samples of the stack of a centerline, to start the largest branches first
+double GetSpecSize(const CenterlineSpec &spec)
+{
+  return double(spec.seeds.size() / 3) * spec.resolution * std::max(spec.n_slices, 1);
+}
+
+// Straightened cmprs of several centerlines on one decoded volume (eg. the branches of a vessel tree), one result
+// per centerline in the given order. The branches and their sampling share the worker pool and the largest
+// branches are started first, so the batch ends close to the time of its largest branch.
+std::vector<CmprResult> ComputeCmprStraightBatch(vtkImageData *image,
+                                                 const std::vector<float> &metadata,
+                                                 const double scalar_range[2],
+                                                 const std::vector<CenterlineSpec> &specs,
+                                                 const CmprOptions &options)
+{
+  CancelScope cancel_scope(options.cancel);
+  std::vector<int> order(specs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&specs](int a, int b) { return GetSpecSize(specs[a]) > GetSpecSize(specs[b]); });
+
+  // a single trace for the whole batch is written below
+  CmprOptions branch_options = options;
+  branch_options.trace_file.clear();
+
+  vtkSmartPointer<vtkImageData> volume = image;
+  std::vector<CmprResult> results(specs.size());
+  std::vector<double> start_us(specs.size());
+  StageTimer timer;
+
+  ParallelFor(int(specs.size()), options.threads, [&](int item) {
+    CheckCancelled();
+    int b = order[item];
+    const CenterlineSpec &spec = specs[b];
+    start_us[b] = timer.GetElapsedUs();
+    results[b] = ComputeCmprStraight([&volume](const double *) { return volume; }, metadata, scalar_range,
+                                     spec.seeds, spec.tng, spec.ptn, spec.resolution, spec.dir, spec.stack_direction,
+                                     spec.slice_dimension, spec.dist_slices, spec.n_slices, false, branch_options);
+  });
+
+  CMPR_LOG(LOG_INFO, "Batch of " << specs.size() << " centerlines : " << timer.GetElapsedUs() / 1000.0 << " [ms]");
+
+  // one track per branch, on the batch clock
+  if (!options.trace_file.empty())
+  {
+    std::vector<StageTiming> stages;
+    for (size_t b = 0; b < results.size(); b++)
+    {
+      for (StageTiming timing : results[b].timings)
+      {
+        timing.start_us += start_us[b];
+        timing.track = int(b) + 1;
+        stages.push_back(timing);
+      }
+    }
+    WriteChromeTrace(options.trace_file, stages);
+  }
+
+  return results;
+}
+
+// Batch of straightened cmprs on a nrrd volume, read once for every centerline
+std::vector<CmprResult> compute_cmpr_straight_batch(std::string volumeFileName,
+                                                    std::vector<CenterlineSpec> specs,
+                                                    const CmprOptions &options)
+{
+  CancelScope cancel_scope(options.cancel);
+  CMPR_LOG(LOG_INFO, "InputVolume: " << volumeFileName);
+
+  // the whole volume is shared by the branches: mapped for raw nrrd, inflated for gzip nrrd, or read
+  std::shared_ptr<MappedFile> mapping;
+  vtkSmartPointer<vtkImageData> image = ReadNrrd(volumeFileName, mapping, options.threads, nullptr);
+  std::vector<float> metadata = GetMetadata(image);
+
+  // computed once here, vtkDataSet caches the range and must not do it from several threads
+  double scalar_range[2];
+  image->GetScalarRange(scalar_range);
+
+  return ComputeCmprStraightBatch(image, metadata, scalar_range, specs, options);
+}
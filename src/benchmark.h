@@ -0,0 +1,341 @@
+// Benchmark of every cmpr stage on synthetic volumes and centerlines, built as the cmpr_benchmark executable
+
+// Durations of each stage over the runs of a case, in stage order
+struct BenchmarkTimings
+{
+  std::vector<std::string> stages;
+  std::map<std::string, std::vector<double>> ms;
+};
+
+template <class TBody>
+void TimeStage(BenchmarkTimings &timings, const std::string &stage, TBody body)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  body();
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  if (timings.ms.find(stage) == timings.ms.end())
+  {
+    timings.stages.push_back(stage);
+  }
+  timings.ms[stage].push_back(ms);
+}
+
+// Smooth synthetic content: sums of waves, scaled to the scalar type range (at most the CT range)
+template <class TScalar>
+void FillSyntheticVolume(vtkImageData *image, int n_threads)
+{
+  TScalar *scalars = static_cast<TScalar *>(image->GetScalarPointer());
+  int *dims = image->GetDimensions();
+  double low = std::max(double(std::numeric_limits<TScalar>::lowest()), -1024.0);
+  double high = std::min(double(std::numeric_limits<TScalar>::max()), 3071.0);
+
+  ParallelFor(dims[2], n_threads, [&](int k) {
+    for (int j = 0; j < dims[1]; j++)
+    {
+      TScalar *row = scalars + (vtkIdType(k) * dims[1] + j) * dims[0];
+      for (int i = 0; i < dims[0]; i++)
+      {
+        double wave = (std::sin(i * 0.07) + std::cos(j * 0.05) + std::sin(k * 0.11 + i * 0.01)) / 3.0;
+        row[i] = TScalar(low + (high - low) * 0.5 * (wave + 1.0));
+      }
+    }
+  });
+}
+
+vtkSmartPointer<vtkImageData> CreateSyntheticVolume(const int dims[3], double spacing, int scalar_type, int n_threads)
+{
+  vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+  image->SetDimensions(dims[0], dims[1], dims[2]);
+  image->SetSpacing(spacing, spacing, spacing);
+  image->SetOrigin(0.0, 0.0, 0.0);
+  image->AllocateScalars(scalar_type, 1);
+  image->GetPointData()->GetScalars()->SetName("ImageFile"); // as vtkNrrdReader names it
+
+  switch (scalar_type)
+  {
+    vtkTemplateMacro(FillSyntheticVolume<VTK_TT>(image, n_threads));
+  default:
+    std::cout << "unsupported scalar type " << scalar_type << std::endl;
+  }
+
+  return image;
+}
+
+// Centerline seeds in world coordinates: a helix around the volume axis, tortuous adds waves to its radius and pitch
+std::vector<float> CreateSyntheticCenterline(vtkImageData *image, bool tortuous, int n_points)
+{
+  double bounds[6];
+  image->GetBounds(bounds);
+  double center[2] = {(bounds[0] + bounds[1]) / 2, (bounds[2] + bounds[3]) / 2};
+  double radius = 0.25 * std::min(bounds[1] - bounds[0], bounds[3] - bounds[2]);
+  double z0 = bounds[4] + 0.1 * (bounds[5] - bounds[4]);
+  double height = 0.8 * (bounds[5] - bounds[4]);
+  double turns = 3.0;
+
+  std::vector<float> seeds;
+  for (int p = 0; p < n_points; p++)
+  {
+    double t = double(p) / (n_points - 1);
+    double angle = 2.0 * vtkMath::Pi() * turns * t;
+    double r = radius;
+    double z = z0 + height * t;
+    if (tortuous)
+    {
+      r *= 1.0 + 0.3 * std::sin(7.0 * angle);
+      z += 0.02 * height * std::sin(11.0 * angle);
+    }
+    seeds.push_back(float(center[0] + r * std::cos(angle)));
+    seeds.push_back(float(center[1] + r * std::sin(angle)));
+    seeds.push_back(float(z));
+  }
+  return seeds;
+}
+
+// Parallel transport normals of the seeds, one per seed, as the python side computes them
+std::vector<float> GetSyntheticNormals(const std::vector<float> &seeds)
+{
+  size_t n = seeds.size() / 3;
+  std::vector<float> normals(3 * n);
+  double normal[3] = {0.0, 0.0, 1.0};
+  double t[3];
+
+  for (size_t p = 0; p < n; p++)
+  {
+    size_t p0 = p > 0 ? p - 1 : 0;
+    size_t p1 = std::min(p + 1, n - 1);
+    for (int a = 0; a < 3; a++)
+    {
+      t[a] = seeds[3 * p1 + a] - seeds[3 * p0 + a];
+    }
+    vtkMath::Normalize(t);
+
+    // remove the tangent component of the previous normal
+    double dt = vtkMath::Dot(normal, t);
+    for (int a = 0; a < 3; a++)
+    {
+      normal[a] -= dt * t[a];
+    }
+    if (vtkMath::Normalize(normal) == 0.0)
+    {
+      vtkMath::Perpendiculars(t, normal, nullptr, 0.0);
+    }
+    for (int a = 0; a < 3; a++)
+    {
+      normals[3 * p + a] = float(normal[a]);
+    }
+  }
+  return normals;
+}
+
+// Time every stage of a straightened cmpr, both sampling paths (probe filter and trilinear)
+BenchmarkTimings RunBenchmarkCase(vtkImageData *image, const std::vector<float> &seeds, int resolution, int n_slices,
+                                  int repeats, int n_threads)
+{
+  std::vector<float> ptn = GetSyntheticNormals(seeds);
+  std::vector<float> stack_direction = {0.0f, 0.0f, 1.0f};
+  double bounds[6];
+  image->GetBounds(bounds);
+  float slice_dimension = float(0.4 * std::min(bounds[1] - bounds[0], bounds[3] - bounds[2]));
+  float dist_slices = float(image->GetSpacing()[2]);
+  double origin[3] = {bounds[0], bounds[2], bounds[4]};
+  double normal[3] = {0.0, 0.0, -1.0};
+  double scalar_range[2];
+  image->GetScalarRange(scalar_range);
+
+  BenchmarkTimings timings;
+  for (int run = 0; run < repeats; run++)
+  {
+    vtkSmartPointer<vtkPolyData> spline;
+    std::vector<double> directions;
+    vtkSmartPointer<vtkPolyData> master_slice;
+    std::map<int, vtkSmartPointer<vtkPolyData>> stack_map;
+    vtkSmartPointer<vtkPolyData> squashed;
+    vtkSmartPointer<vtkProbeFilter> probe;
+    PixelBuffer pixels;
+    ImplicitStack stack;
+    AxialFrames frames;
+    PixelStats stats(scalar_range[0], scalar_range[1]);
+    volatile float window = 0.0f; // keeps the window computation
+
+    TimeStage(timings, "spline", [&] { spline = CreateSpline(seeds, resolution, origin, normal, false); });
+    TimeStage(timings, "smoothing", [&] { directions = GetSweepDirections(spline, ptn, slice_dimension); });
+    // sweep includes its own smoothing
+    TimeStage(timings, "sweep", [&] { master_slice = SweepLine(spline, ptn, slice_dimension, resolution); });
+    TimeStage(timings, "stack", [&] { stack_map = CreateStack(master_slice, n_slices, stack_direction, dist_slices); });
+    TimeStage(timings, "squash", [&] { squashed = Squash(stack_map, false); });
+    TimeStage(timings, "probe", [&] { probe = ProbeImage(image, squashed); });
+    TimeStage(timings, "pixels", [&] { pixels = GetPixelValues(probe->GetOutput(), VTK_FLOAT, false, &stats); });
+    TimeStage(timings, "wwwl", [&] { window = GetWindowLevel(stats, scalar_range, 1.0f)[0]; });
+    TimeStage(timings, "implicit_stack", [&] { stack = CreateImplicitStack(master_slice, n_slices, stack_direction, dist_slices); });
+    TimeStage(timings, "trilinear", [&] { pixels = SampleStack(image, stack, VTK_FLOAT, n_threads, &stats); });
+    TimeStage(timings, "axial_frames", [&] { frames = CreateAxialFrames(spline, 120.0f, resolution); });
+    TimeStage(timings, "axial_trilinear", [&] {
+      pixels = SampleAxialFrames(image, frames, 0, int(frames.basis.size() / 9), VTK_FLOAT, true, n_threads, &stats);
+    });
+    // a single frame as Centerline::axial samples it on a click, the middle one
+    TimeStage(timings, "axial_slice", [&] {
+      int k = int(frames.basis.size() / 18);
+      pixels = SampleAxialFrames(image, frames, k, k + 1, VTK_FLOAT, false, n_threads, nullptr);
+    });
+  }
+  return timings;
+}
+
+// One line per case and stage: best and mean duration over the runs
+void WriteBenchmarkRecord(std::ostream &out, bool csv, bool first, const std::string &volume, const std::string &type,
+                          const std::string &centerline, const std::string &stage, const std::vector<double> &ms)
+{
+  double best = *std::min_element(ms.begin(), ms.end());
+  double mean = std::accumulate(ms.begin(), ms.end(), 0.0) / ms.size();
+
+  if (csv)
+  {
+    out << volume << "," << type << "," << centerline << "," << stage << "," << ms.size() << "," << best << "," << mean << "\n";
+  }
+  else
+  {
+    out << (first ? "" : ",\n") << "    {\"volume\": \"" << volume << "\", \"type\": \"" << type
+        << "\", \"centerline\": \"" << centerline << "\", \"stage\": \"" << stage << "\", \"runs\": " << ms.size()
+        << ", \"min_ms\": " << best << ", \"mean_ms\": " << mean << "}";
+  }
+}
+
+// cmpr_benchmark [results.json|results.csv] [--repeat N] [--threads N] [--quick]
+// cmpr_benchmark --check [--threads N] [--quick]
+// The stages log on stdout, so the results are written to a file (cmpr_benchmark.json by default).
+// --check runs the correctness checks on the synthetic volumes instead (simd kernels, centerline edits, point
+// mapping round trips, load_roi reads), the exit code is their status.
+int RunBenchmark(int argc, char *argv[])
+{
+  std::string output = "cmpr_benchmark.json";
+  int repeats = 3;
+  int n_threads = 0;
+  bool quick = false;
+  bool check = false;
+  for (int a = 1; a < argc; a++)
+  {
+    std::string arg = argv[a];
+    if (arg == "--repeat" && a + 1 < argc)
+    {
+      repeats = std::max(std::atoi(argv[++a]), 1);
+    }
+    else if (arg == "--threads" && a + 1 < argc)
+    {
+      n_threads = std::atoi(argv[++a]);
+    }
+    else if (arg == "--quick")
+    {
+      quick = true;
+    }
+    else if (arg == "--check")
+    {
+      check = true;
+    }
+    else
+    {
+      output = arg;
+    }
+  }
+  const int sizes[3][3] = {{256, 256, 128}, {512, 512, 256}, {512, 512, 512}};
+  const int types[3] = {VTK_SHORT, VTK_UNSIGNED_CHAR, VTK_FLOAT};
+  const int resolution = 256;
+  const int n_seeds = 400;
+  const int n_slices = 16;
+
+  if (check)
+  {
+    bool ok = true;
+    for (int s = 0; s < (quick ? 1 : 3); s++)
+    {
+      for (int t = 0; t < 3; t++)
+      {
+        vtkSmartPointer<vtkImageData> image = CreateSyntheticVolume(sizes[s], 0.5, types[t], n_threads);
+        for (int tortuous = 0; tortuous < 2; tortuous++)
+        {
+          // every supported simd level on the master slice of the benchmark cases
+          std::vector<float> seeds = CreateSyntheticCenterline(image, tortuous != 0, n_seeds);
+          double bounds[6];
+          image->GetBounds(bounds);
+          double origin[3] = {bounds[0], bounds[2], bounds[4]};
+          double normal[3] = {0.0, 0.0, -1.0};
+          vtkSmartPointer<vtkPolyData> spline = CreateSpline(seeds, resolution, origin, normal, false);
+          float slice_dimension = float(0.4 * std::min(bounds[1] - bounds[0], bounds[3] - bounds[2]));
+          std::cout << sizes[s][0] << "x" << sizes[s][1] << "x" << sizes[s][2] << " " << image->GetScalarTypeAsString()
+                    << (tortuous ? " tortuous" : " helix") << std::endl;
+          ok = test_simd(image, SweepLine(spline, GetSyntheticNormals(seeds), slice_dimension, resolution)) && ok;
+          // sessions read a file: only on the smallest volume
+          if (s == 0)
+          {
+            ok = test_centerline_edit(image, seeds, resolution, "cmpr_benchmark_check.nrrd", n_threads) && ok;
+          }
+          // the mapping only depends on the geometry: once per centerline
+          if (s == 0 && t == 0)
+          {
+            ok = test_mapping(image, seeds, resolution, n_threads) && ok;
+          }
+        }
+      }
+    }
+
+    // a volume long along z, the centerline only crosses its middle slices
+    const int roi_dims[3] = {256, 256, 1024};
+    ok = test_load_roi(CreateSyntheticVolume(roi_dims, 0.5, VTK_SHORT, n_threads), "cmpr_benchmark_check.nrrd", n_threads) && ok;
+    std::cout << "checks " << (ok ? "passed" : "failed") << std::endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  bool csv = output.size() > 4 && output.compare(output.size() - 4, 4, ".csv") == 0;
+
+  std::ofstream out(output.c_str());
+  if (!out)
+  {
+    std::cout << "cannot write " << output << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (csv)
+  {
+    out << "volume,type,centerline,stage,runs,min_ms,mean_ms\n";
+  }
+  else
+  {
+    out << "{\n  \"simd_level\": " << GetSimdLevel() << ",\n  \"threads\": "
+        << (n_threads > 0 ? n_threads : GetHardwareThreads()) << ",\n  \"results\": [\n";
+  }
+
+  bool first = true;
+  for (int s = 0; s < (quick ? 1 : 3); s++)
+  {
+    std::ostringstream volume;
+    volume << sizes[s][0] << "x" << sizes[s][1] << "x" << sizes[s][2];
+
+    for (int t = 0; t < 3; t++)
+    {
+      vtkSmartPointer<vtkImageData> image = CreateSyntheticVolume(sizes[s], 0.5, types[t], n_threads);
+      std::string type = image->GetScalarTypeAsString();
+
+      for (int tortuous = 0; tortuous < 2; tortuous++)
+      {
+        std::string centerline = tortuous ? "tortuous" : "helix";
+        std::vector<float> seeds = CreateSyntheticCenterline(image, tortuous != 0, n_seeds);
+        BenchmarkTimings timings = RunBenchmarkCase(image, seeds, resolution, n_slices, repeats, n_threads);
+
+        for (size_t st = 0; st < timings.stages.size(); st++)
+        {
+          const std::string &stage = timings.stages[st];
+          WriteBenchmarkRecord(out, csv, first, volume.str(), type, centerline, stage, timings.ms[stage]);
+          first = false;
+        }
+        out.flush();
+      }
+    }
+  }
+
+  if (!csv)
+  {
+    out << "\n  ]\n}\n";
+  }
+  std::cout << "benchmark results: " << output << std::endl;
+
+  return EXIT_SUCCESS;
+}
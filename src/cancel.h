@@ -0,0 +1,62 @@
+// Raised in a request whose CancelToken was cancelled, returned to python as cmpr.Cancelled
+class CmprCancelled : public std::runtime_error
+{
+public:
+  CmprCancelled() : std::runtime_error("cmpr request cancelled") {}
+};
+
+// Cooperative cancellation of a request, Cancel may be called from any thread (eg. when a newer request
+// supersedes it). The request checks it when a stage starts and before every block of samples.
+class CancelToken
+{
+public:
+  CancelToken() : cancelled(false) {}
+
+  void Cancel()
+  {
+    cancelled = true;
+  }
+
+  bool IsCancelled() const
+  {
+    return cancelled;
+  }
+
+private:
+  std::atomic<bool> cancelled;
+};
+
+// Token of the request running on the calling thread, nullptr if it cannot be cancelled
+std::shared_ptr<CancelToken> &GetThreadCancelToken()
+{
+  thread_local std::shared_ptr<CancelToken> token;
+  return token;
+}
+
+// Sets the token of the calling thread for the duration of a request, nested requests restore the outer token
+class CancelScope
+{
+public:
+  CancelScope(std::shared_ptr<CancelToken> token) : previous(GetThreadCancelToken())
+  {
+    GetThreadCancelToken() = token;
+  }
+
+  ~CancelScope()
+  {
+    GetThreadCancelToken() = previous;
+  }
+
+private:
+  std::shared_ptr<CancelToken> previous;
+};
+
+// Throws CmprCancelled if the request of the calling thread was cancelled
+void CheckCancelled()
+{
+  const std::shared_ptr<CancelToken> &token = GetThreadCancelToken();
+  if (token && token->IsCancelled())
+  {
+    throw CmprCancelled();
+  }
+}
@@ -0,0 +1,269 @@
+// Centerline session on an open volume: the spline and its axial frames are computed once,
+// then cross-sections are sampled on demand (eg. one per scroll event) and an edit of the
+// centerline only resamples the part of the straightened cmpr it moved
+class Centerline
+{
+public:
+  Centerline(std::shared_ptr<Volume> volume,
+             std::vector<float> seeds,
+             unsigned int resolution,
+             float side_length,
+             const CmprOptions &options)
+      : volume(volume), options(options), pixel_type(GetPixelType(options, volume->image)), resolution(resolution), side_length(side_length), seeds(seeds), sweep_distance(0)
+  {
+    // the edits sample the plain stack with the trilinear sampler, other requests go through the volume session
+    if (options.slab != SLAB_NONE)
+    {
+      throw std::invalid_argument("Centerline: slab options are not supported, use Volume.straight");
+    }
+    if (options.sampler != SAMPLER_TRILINEAR)
+    {
+      throw std::invalid_argument("Centerline: only the trilinear sampler is supported");
+    }
+    if (options.viewport.IsSet())
+    {
+      throw std::invalid_argument("Centerline: viewports are not supported, use Volume.straight");
+    }
+    if (options.on_preview)
+    {
+      throw std::invalid_argument("Centerline: previews are not supported, use Volume.straight");
+    }
+
+    std::copy(volume->metadata.begin(), volume->metadata.begin() + 3, origin);
+
+    spline = CreateSpline(seeds, resolution, origin, normal, false);
+    frames = CreateAxialFrames(spline, side_length, resolution);
+    GetAxialIOPIPP(frames, iop_axial, ipp_axial);
+  }
+
+  // The axial geometry is replaced by every edit: it is only read under the session lock, and copied out
+  int GetNumberOfFrames()
+  {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    return CountFrames();
+  }
+
+  double GetAxialSpacing()
+  {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    return frames.spacing;
+  }
+
+  std::vector<float> GetIOPAxial()
+  {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    return iop_axial;
+  }
+
+  std::vector<float> GetIPPAxial()
+  {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    return ipp_axial;
+  }
+
+  // Pixels of axial frames [k0, k1), in spline order, each oriented as its iop_axial entry.
+  // side: pixels along each side of a frame, read with them
+  PixelBuffer axial(int k0, int k1, size_t &side)
+  {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    if (k0 < 0 || k1 > CountFrames() || k0 >= k1)
+    {
+      throw std::out_of_range("axial frames [" + std::to_string(k0) + ", " + std::to_string(k1) +
+                              ") out of [0, " + std::to_string(CountFrames()) + ")");
+    }
+
+    side = size_t(frames.resolution) + 1;
+    return SampleAxialFrames(volume->image, frames, k0, k1, pixel_type, false, options.threads, nullptr);
+  }
+
+  // Straightened cmpr of the edited centerline, same response as compute_cmpr_straight with the session options
+  // (trilinear sampler, no slab, viewport or preview: the constructor refuses them).
+  // The surface and the pixels of the previous call are kept: only the rows whose spline point or
+  // sweep direction moved, and the axial frames whose plane moved, are swept and sampled again.
+  // Calls on a session run one at a time: cancel the token of a superseded edit to start the next one sooner.
+  CmprResult straight(std::vector<float> new_seeds,
+                      std::vector<float> tng,
+                      std::vector<float> ptn,
+                      std::vector<float> stack_direction,
+                      float slice_dimension,
+                      float dist_slices,
+                      int n_slices,
+                      std::shared_ptr<CancelToken> cancel)
+  {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    CancelScope cancel_scope(cancel ? cancel : options.cancel);
+    StageTimer timer;
+    CheckCancelled(); // a cancelled edit stops between stages, never once the new geometry is kept
+    timer.Start("spline");
+    vtkSmartPointer<vtkPolyData> new_spline = CreateSpline(new_seeds, resolution, origin, normal, false);
+    std::vector<double> new_directions = GetSweepDirections(new_spline, ptn, slice_dimension);
+    AxialFrames new_frames = CreateAxialFrames(new_spline, side_length, resolution);
+    std::vector<double> offsets = GetStackOffsets(n_slices, stack_direction, dist_slices);
+
+    int rows = int(new_spline->GetNumberOfPoints()) - 1;
+    int cols = int(resolution);
+    int n_frames = int(new_frames.basis.size() / 9);
+    vtkIdType n = vtkIdType(rows) * cols;
+    vtkIdType m = vtkIdType(resolution + 1) * (resolution + 1);
+
+    // A different layout of the output: nothing can be reused
+    bool reuse = pixels_cmpr.size > 0 && new_seeds.size() == seeds.size() &&
+                 offsets == stack_offsets && slice_dimension == sweep_distance;
+    if (!reuse)
+    {
+      surface.assign(3 * n, 0.0f);
+      pixels_cmpr = PixelBuffer(pixel_type, n * (offsets.size() / 3));
+      pixels_axial = PixelBuffer(pixel_type, m * n_frames);
+    }
+
+    // Rows whose spline point or sweep direction moved
+    std::vector<bool> changed_rows(rows, !reuse);
+    for (int row = 0; reuse && row < rows; row++)
+    {
+      changed_rows[row] = !SamePoint(new_spline, spline, row) ||
+                          !std::equal(&new_directions[3 * row], &new_directions[3 * row] + 3, &directions[3 * row]);
+    }
+
+    // Axial frames whose plane moved, stored in reverse order as in the cmpr response
+    std::vector<bool> changed_frames(n_frames, !reuse);
+    for (int frame = 0; reuse && frame < n_frames; frame++)
+    {
+      changed_frames[frame] = !std::equal(&new_frames.basis[9 * frame], &new_frames.basis[9 * frame] + 9, &frames.basis[9 * frame]);
+    }
+
+    int resampled_rows = 0;
+    int resampled_frames = 0;
+    try
+    {
+      // rows are swept and sampled run by run
+      CheckCancelled();
+      timer.Start("probe");
+      for (int begin = 0, end = 0; begin < rows; begin = end)
+      {
+        end = GetRunEnd(changed_rows, begin);
+        if (changed_rows[begin])
+        {
+          SweepRows(new_spline, new_directions, slice_dimension, cols, begin, end, surface.data());
+          SampleStackRange(volume->image, surface.data(), n, vtkIdType(begin) * cols, vtkIdType(end) * cols,
+                           offsets, pixels_cmpr, options.threads);
+          resampled_rows += end - begin;
+        }
+      }
+
+      CheckCancelled();
+      timer.Start("axial");
+      for (int begin = 0, end = 0; begin < n_frames; begin = end)
+      {
+        end = GetRunEnd(changed_frames, begin);
+        if (changed_frames[begin])
+        {
+          PixelBuffer values = SampleAxialFrames(volume->image, new_frames, begin, end, pixel_type, true, options.threads, nullptr);
+          std::copy(values.bytes.begin(), values.bytes.end(), pixels_axial.bytes.begin() + (n_frames - end) * m * values.GetElementSize());
+          resampled_frames += end - begin;
+        }
+      }
+    }
+    catch (...)
+    {
+      // the buffers are partly updated (eg. a cancelled edit) and no longer match the kept geometry:
+      // the next edit resamples everything
+      pixels_cmpr = PixelBuffer();
+      throw;
+    }
+
+    CMPR_LOG(LOG_DEBUG, "Resampled rows: " << resampled_rows << "/" << rows
+                                            << ", axial frames: " << resampled_frames << "/" << n_frames);
+
+    // Keep the new geometry for the next edit
+    seeds = new_seeds;
+    spline = new_spline;
+    directions = new_directions;
+    frames = new_frames;
+    stack_offsets = offsets;
+    sweep_distance = slice_dimension;
+    iop_axial.clear();
+    ipp_axial.clear();
+    GetAxialIOPIPP(frames, iop_axial, ipp_axial);
+
+    // Compose response, the pixels are copied since the session keeps updating its own buffers
+    CmprResult response;
+
+    timer.Start("wwwl");
+    float mean_pts_distance = GetMeanDistanceBtwPoints(spline);
+    // the buffers are only partly resampled: their stats take one pass, as the min/max range did
+    const double *scalar_range = volume->GetScalarRange();
+    std::vector<float> wwwl_cmpr = GetWindowLevel(GetPixelStats(pixels_cmpr, scalar_range), scalar_range, options.wwwl_percentile);
+    std::vector<float> wwwl_axial = GetWindowLevel(GetPixelStats(pixels_axial, scalar_range), scalar_range, options.wwwl_percentile);
+    timer.Stop();
+
+    response.fields["metadata"] = volume->metadata;
+    response.fields["dimension_cmpr"] = {float(rows), float(cols), float(offsets.size() / 3)};
+    response.fields["dimension_axial"] = {float(resolution + 1), float(resolution + 1), float(n_frames)};
+    response.fields["spacing_cmpr"] = {slice_dimension / float(resolution), mean_pts_distance};
+    response.fields["spacing_axial"] = {float(frames.spacing), float(frames.spacing)};
+    response.fields["wwwl_cmpr"] = wwwl_cmpr;
+    response.fields["wwwl_axial"] = wwwl_axial;
+    response.fields["iop_axial"] = iop_axial;
+    response.fields["ipp_axial"] = ipp_axial;
+    response.fields["resampled"] = {float(resampled_rows), float(resampled_frames)};
+    response.mapping = std::make_shared<CmprMapping>(spline, rows, directions, offsets, slice_dimension / double(cols), -(cols / 2), frames);
+    response.pixels_cmpr = pixels_cmpr;
+    response.pixels_axial = pixels_axial;
+    response.timings = timer.stages;
+
+    if (!options.trace_file.empty())
+    {
+      WriteChromeTrace(options.trace_file, response.timings);
+    }
+
+    return response;
+  }
+
+  std::shared_ptr<Volume> volume;
+  CmprOptions options;
+  int pixel_type;
+  unsigned int resolution;
+  float side_length;
+  double origin[3];
+  double normal[3] = {0.0, 0.0, 1.0}; // only used to project the spline
+  std::vector<float> seeds;
+  vtkSmartPointer<vtkPolyData> spline;
+
+  // Straightened cmpr of the last edit
+  std::vector<double> directions;    // sweep direction of each row
+  std::vector<double> stack_offsets; // shift of each slice
+  float sweep_distance;
+  std::vector<float> surface;      // master slice points, rows x cols
+  PixelBuffer pixels_cmpr;  // slices x rows x cols
+  PixelBuffer pixels_axial; // axial frames, last to first
+
+private:
+  std::mutex session_mutex; // one call at a time, an edit updates the buffers and the axial geometry
+  AxialFrames frames;
+  std::vector<float> iop_axial;
+  std::vector<float> ipp_axial;
+
+  int CountFrames() const
+  {
+    return int(frames.basis.size() / 9);
+  }
+
+  static bool SamePoint(vtkPolyData *a, vtkPolyData *b, vtkIdType i)
+  {
+    double pa[3], pb[3];
+    a->GetPoint(i, pa);
+    b->GetPoint(i, pb);
+    return pa[0] == pb[0] && pa[1] == pb[1] && pa[2] == pb[2];
+  }
+
+  // End of the run of equal flags starting at begin
+  static int GetRunEnd(const std::vector<bool> &flags, int begin)
+  {
+    int end = begin + 1;
+    while (end < int(flags.size()) && flags[end] == flags[begin])
+    {
+      end++;
+    }
+    return end;
+  }
+};
@@ -1,33 +1,119 @@
-std::map<std::string, std::vector<float>> compute_cmpr_straight(std::string volumeFileName,
-                                                                std::vector<float> seeds,
-                                                                std::vector<float> tng,
-                                                                std::vector<float> ptn,
-                                                                unsigned int resolution,
-                                                                std::vector<int> dir,
-                                                                std::vector<float> stack_direction,
-                                                                float slice_dimension,
-                                                                float dist_slices,
-                                                                int n_slices,
-                                                                bool render)
+CmprResult compute_cmpr_straight(std::string volumeFileName,
+                                 std::vector<float> seeds,
+                                 std::vector<float> tng,
+                                 std::vector<float> ptn,
+                                 unsigned int resolution,
+                                 std::vector<int> dir,
+                                 std::vector<float> stack_direction,
+                                 float slice_dimension,
+                                 float dist_slices,
+                                 int n_slices,
+                                 bool render,
+                                 const CmprOptions &options)
 {
-    time_t time_0;
-    time(&time_0);
+    // Print arguments
+    CMPR_LOG(LOG_INFO, "InputVolume: " << volumeFileName);
+
+    // Only the header is read here: the geometry is computed on the whole volume, then the voxels
+    // around the sampled surfaces are loaded (mapped for raw nrrd, inflated for gzip nrrd, or read)
+    vtkSmartPointer<vtkImageData> information = ReadNrrdInformation(volumeFileName);
+    std::vector<float> metadata = GetMetadata(information);
+
+    std::shared_ptr<MappedFile> mapping;
+    VolumeLoader load = [&](const double bounds[6]) {
+        int extent[6];
+        GetBoundsExtent(information, bounds, 1, extent);
+        return ReadNrrd(volumeFileName, mapping, options.threads, options.load_roi ? extent : nullptr);
+    };
+
+    return ComputeCmprStraight(load, metadata, nullptr,
+                               seeds, tng, ptn, resolution, dir, stack_direction, slice_dimension, dist_slices, n_slices, render, options);
+}
+
+CmprResult compute_cmpr_stretch(std::string volumeFileName,
+                                std::vector<float> seeds,
+                                unsigned int resolution,
+                                std::vector<int> dir,
+                                std::vector<float> stack_direction,
+                                float dist_slices,
+                                int n_slices,
+                                bool render,
+                                const CmprOptions &options)
+{
+    // Print arguments
+    CMPR_LOG(LOG_INFO, "InputVolume: " << volumeFileName);
+
+    // Only the header is read here: the geometry is computed on the whole volume, then the voxels
+    // around the sampled surfaces are loaded (mapped for raw nrrd, inflated for gzip nrrd, or read)
+    vtkSmartPointer<vtkImageData> information = ReadNrrdInformation(volumeFileName);
+    std::vector<float> metadata = GetMetadata(information);
+
+    std::shared_ptr<MappedFile> mapping;
+    VolumeLoader load = [&](const double bounds[6]) {
+        int extent[6];
+        GetBoundsExtent(information, bounds, 1, extent);
+        return ReadNrrd(volumeFileName, mapping, options.threads, options.load_roi ? extent : nullptr);
+    };
+
+    return ComputeCmprStretch(load, metadata, nullptr,
+                              seeds, resolution, dir, stack_direction, dist_slices, n_slices, render, options);
+}
+
+CmprResult compute_cmpr_rotational(std::string volumeFileName,
+                                   std::vector<float> seeds,
+                                   std::vector<float> tng,
+                                   std::vector<float> ptn,
+                                   unsigned int resolution,
+                                   std::vector<int> dir,
+                                   float slice_dimension,
+                                   int n_angles,
+                                   const CmprOptions &options)
+{
+    // Print arguments
+    CMPR_LOG(LOG_INFO, "InputVolume: " << volumeFileName);
+
+    // Only the header is read here, as for compute_cmpr_straight
+    vtkSmartPointer<vtkImageData> information = ReadNrrdInformation(volumeFileName);
+    std::vector<float> metadata = GetMetadata(information);
+
+    std::shared_ptr<MappedFile> mapping;
+    VolumeLoader load = [&](const double bounds[6]) {
+        int extent[6];
+        GetBoundsExtent(information, bounds, 1, extent);
+        return ReadNrrd(volumeFileName, mapping, options.threads, options.load_roi ? extent : nullptr);
+    };
+
+    return ComputeCmprRotational(load, metadata, nullptr, seeds, tng, ptn, resolution, dir, slice_dimension, n_angles, options);
+}
+
+// Straightened cmpr, the volume is loaded once the sampled region is known.
+// scalar_range: range of the whole volume, nullptr to use the range of the voxels around the samples (no other page
+// of a mapped volume is read)
+CmprResult ComputeCmprStraight(const VolumeLoader &load,
+                               const std::vector<float> &metadata,
+                               const double *scalar_range,
+                               std::vector<float> seeds,
+                               std::vector<float> tng,
+                               std::vector<float> ptn,
+                               unsigned int resolution,
+                               std::vector<int> dir,
+                               std::vector<float> stack_direction,
+                               float slice_dimension,
+                               float dist_slices,
+                               int n_slices,
+                               bool render,
+                               const CmprOptions &options)
+{
+    CancelScope cancel_scope(options.cancel);
+    StageTimer timer;
 
     // Parse input
     double direction[3];
     std::copy(dir.begin(), dir.end(), direction);
 
     // Print arguments
-    std::cout << "InputVolume: " << volumeFileName << std::endl
-              << "Resolution: " << resolution << std::endl
-              << "Seeds: " << seeds.size() / 3 << std::endl;
-
-    // Read the volume data
-    vtkSmartPointer<vtkNrrdReader> reader = vtkSmartPointer<vtkNrrdReader>::New();
-    reader->SetFileName(volumeFileName.c_str());
-    reader->Update();
-
-    std::vector<float> metadata = GetMetadata(reader->GetOutput());
+    CMPR_LOG(LOG_DEBUG, "Resolution: " << resolution << std::endl
+                                       << "Seeds: " << seeds.size() / 3);
 
     double origin[3] = {
         metadata[0],
@@ -40,124 +126,227 @@ std::map<std::string, std::vector<float>> compute_cmpr_straight(std::string volu
         -direction[2]};
 
     // Recreate source spline
+    CheckCancelled(); // a cancelled request stops between stages, and between blocks of samples
+    timer.Start("spline");
     vtkSmartPointer<vtkPolyData> original_spline = vtkSmartPointer<vtkPolyData>::New();
     original_spline = CreateSpline(seeds, resolution, origin, neg_direction, false);
 
-    // Sweep the line to form a surface
-    vtkSmartPointer<vtkPolyData> master_slice = SweepLine(original_spline, ptn, slice_dimension, resolution);
-
-    // Shift the master slice to create a stack
-    std::map<int, vtkSmartPointer<vtkPolyData>> stack_map = CreateStack(master_slice, n_slices, stack_direction, dist_slices);
-
-    // Squash stack map into a single polydata
-    vtkSmartPointer<vtkPolyData> complete_stack = Squash(stack_map, false);
+    // Sweep the line to form a surface, or only the part of it in the viewport
+    CheckCancelled();
+    timer.Start("sweep");
+    std::vector<double> sweep_directions = GetSweepDirections(original_spline, ptn, slice_dimension);
+    int rows = int(original_spline->GetNumberOfPoints()) - 1;
+    int n_images = options.slab == SLAB_NONE ? int(GetStackOffsets(n_slices, stack_direction, dist_slices).size() / 3) : 1;
+    bool viewport = options.viewport.IsSet();
+    CmprViewport view; // all the slices without a viewport
+    view.slice_end = n_images;
+    if (viewport)
+    {
+        view = ResolveViewport(options.viewport, rows, int(resolution), n_images);
+    }
+    vtkSmartPointer<vtkPolyData> master_slice = viewport ? SweepViewport(original_spline, sweep_directions, slice_dimension, resolution, view)
+                                                         : SweepSurface(original_spline, sweep_directions, slice_dimension, resolution);
+
+    // Describe the stack as the master slice plus one offset per slice
+    CheckCancelled();
+    timer.Start("stack");
+    // or the samples across the slab, reduced to a single image
+    ImplicitStack stack = options.slab == SLAB_NONE ? CreateImplicitStack(master_slice, n_slices, stack_direction, dist_slices)
+                                                    : CreateSlab(master_slice, stack_direction, options.slab_thickness, options.slab_samples);
+    if (options.slab == SLAB_NONE)
+    {
+        // only the slices of the viewport
+        stack.offsets = std::vector<double>(stack.offsets.begin() + 3 * view.slice_begin, stack.offsets.begin() + 3 * view.slice_end);
+        n_images = view.slice_end - view.slice_begin;
+    }
+    std::vector<double> image_offsets = options.slab == SLAB_NONE ? stack.offsets : std::vector<double>(3, 0.0);
 
-    // Compute axial stack
+    // Compute axial stack, the frames of the rows in the viewport
+    CheckCancelled();
+    timer.Start("axial");
     float axial_side_length = 120.0;
     std::vector<float> iop_axial;
     std::vector<float> ipp_axial;
-    std::map<int, vtkSmartPointer<vtkPolyData>> axial_stack_map = CreateAxialStack(original_spline, axial_side_length, resolution, iop_axial, ipp_axial);
-
-    // Squash stack map into a single polydata
-    vtkSmartPointer<vtkPolyData> complete_axial_stack = Squash(axial_stack_map, false);
+    AxialFrames axial_frames = CreateAxialFrames(original_spline, axial_side_length, resolution);
+    if (viewport)
+    {
+        int first_frame = int(std::floor(view.row_begin));
+        int last_frame = std::min(int(std::ceil(view.row_end)), rows);
+        axial_frames.basis = std::vector<double>(axial_frames.basis.begin() + 9 * first_frame, axial_frames.basis.begin() + 9 * last_frame);
+    }
+    int n_frames = int(axial_frames.basis.size() / 9);
+    GetAxialIOPIPP(axial_frames, iop_axial, ipp_axial);
+
+    // Load the volume, the region sampled by the stack and the axial planes is known from here
+    CheckCancelled();
+    timer.Start("read");
+    double sample_bounds[6];
+    GetSampleBounds(stack, axial_frames, sample_bounds);
+    vtkSmartPointer<vtkImageData> image = load(sample_bounds);
+    double loaded_range[2];
+    if (!scalar_range)
+    {
+        GetBoundsScalarRange(image, sample_bounds, options.threads, loaded_range);
+        scalar_range = loaded_range;
+    }
 
     // Probe the volume with the extruded surfaces
-    vtkSmartPointer<vtkProbeFilter> sampleVolume = vtkSmartPointer<vtkProbeFilter>::New();
-    sampleVolume->SetInputConnection(1, reader->GetOutputPort());
-    sampleVolume->SetInputData(0, complete_stack);
-    sampleVolume->Update();
-
-    vtkSmartPointer<vtkProbeFilter> sampleVolumeAxial = vtkSmartPointer<vtkProbeFilter>::New();
-    sampleVolumeAxial->SetInputConnection(1, reader->GetOutputPort());
-    sampleVolumeAxial->SetInputData(0, complete_axial_stack);
-    sampleVolumeAxial->Update();
-
-    time_t time_1;
-    time(&time_1);
-
-    std::cout << "Total : " << difftime(time_1, time_0) << "[s]" << std::endl;
-
-    // Get values from probe output
-    std::vector<float> values_cmpr = GetPixelValues(sampleVolume->GetOutput(), false);
-    std::vector<float> values_axial = GetPixelValues(sampleVolumeAxial->GetOutput(), true);
+    int pixel_type = GetPixelType(options, image);
+    PixelBuffer values_cmpr;
+    PixelBuffer values_axial;
+    // range and histogram of the pixels, counted while they are written
+    PixelStats stats_cmpr(scalar_range[0], scalar_range[1]);
+    PixelStats stats_axial(scalar_range[0], scalar_range[1]);
+    vtkSmartPointer<vtkProbeFilter> sampleVolume;
+
+    // Slabs are reduced inside the trilinear sampler
+    if (options.sampler == SAMPLER_TRILINEAR || options.slab != SLAB_NONE)
+    {
+        // Slices are generated on the fly while sampling, the pixels are extracted at once
+        CheckCancelled();
+        timer.Start("probe");
+        values_cmpr = options.slab == SLAB_NONE ? SampleStack(image, stack, pixel_type, options.threads, &stats_cmpr)
+                                                : SampleSlab(image, stack, options.slab, pixel_type, options.threads, &stats_cmpr);
+        values_axial = SampleAxialFrames(image, axial_frames, 0, n_frames, pixel_type, true, options.threads, &stats_axial);
+    }
+    else
+    {
+        // Shift the master slice to create a stack and squash it into a single polydata
+        CheckCancelled();
+        timer.Start("squash");
+        std::map<int, vtkSmartPointer<vtkPolyData>> slices = CreateStack(master_slice, n_slices, stack_direction, dist_slices);
+        std::map<int, vtkSmartPointer<vtkPolyData>> viewport_slices; // numbered from 0 as Squash expects
+        for (int s = view.slice_begin; s < view.slice_end; s++)
+        {
+            viewport_slices[s - view.slice_begin] = slices[s];
+        }
+        vtkSmartPointer<vtkPolyData> squashed = Squash(viewport_slices, false);
+        vtkSmartPointer<vtkPolyData> axial_planes = AxialFramesToPolyData(axial_frames);
+
+        CheckCancelled();
+        timer.Start("probe");
+        sampleVolume = ProbeImage(image, squashed);
+        vtkSmartPointer<vtkProbeFilter> sampleVolumeAxial = ProbeImage(image, axial_planes);
+
+        // Get values from probe output
+        timer.Start("extract");
+        values_cmpr = GetPixelValues(sampleVolume->GetOutput(), pixel_type, false, &stats_cmpr);
+        values_axial = GetPixelValues(sampleVolumeAxial->GetOutput(), pixel_type, true, &stats_axial);
+    }
 
-    std::map<std::string, std::vector<float>> response;
+    CmprResult response;
 
     // Compute mean distance btw points to be returned as image spacing
+    timer.Start("wwwl");
     float mean_pts_distance = GetMeanDistanceBtwPoints(original_spline);
-    // float range = GetWindowWidth(reader->GetOutput());
-    float range_cmpr = GetWindowWidth(values_cmpr, reader->GetOutput()->GetScalarRange()[1], reader->GetOutput()->GetScalarRange()[0]);
-    float range_axial = GetWindowWidth(values_axial, reader->GetOutput()->GetScalarRange()[1], reader->GetOutput()->GetScalarRange()[0]);
+    std::vector<float> wwwl_cmpr = GetWindowLevel(stats_cmpr, scalar_range, options.wwwl_percentile);
+    std::vector<float> wwwl_axial = GetWindowLevel(stats_axial, scalar_range, options.wwwl_percentile);
+    timer.Stop();
+
+    CMPR_LOG(LOG_INFO, "Total : " << timer.GetElapsedUs() / 1000.0 << " [ms]");
 
 #ifdef DYNAMIC_VMTK
     // Render
     if (render)
     {
-        int res = renderAll(original_spline, sampleVolume, reader->GetOutput(), slice_dimension, range_cmpr);
+        if (!sampleVolume)
+        {
+            sampleVolume = ProbeImage(image, Squash(CreateStack(master_slice, n_slices, stack_direction, dist_slices), false));
+        }
+        int res = renderAll(original_spline, sampleVolume, image, slice_dimension, wwwl_cmpr[0]);
     }
 #endif
 
-    // Compose response with metadata
+    // Compose response with metadata, a viewport has its own pixel size
+    float row_step = viewport ? (view.row_end - view.row_begin) / view.out_rows : 1.0f;
+    float col_step = viewport ? (view.col_end - view.col_begin) / view.out_cols : 1.0f;
     std::vector<float> dimension_cmpr = {
-        float(seeds.size() / 3 - 1),
-        float(resolution),
-        GetDimensions(stack_map)[2]};
-    std::vector<float>
-        dimension_axial = GetDimensions(axial_stack_map);
+        viewport ? float(view.out_rows) : float(seeds.size() / 3 - 1),
+        viewport ? float(view.out_cols) : float(resolution),
+        float(n_images)};
+    std::vector<float> dimension_axial = {
+        float(resolution + 1),
+        float(resolution + 1),
+        float(n_frames)};
     std::vector<float> spacing_cmpr = {
-        slice_dimension / float(resolution),
-        mean_pts_distance};
+        slice_dimension / float(resolution) * col_step,
+        mean_pts_distance * row_step};
     std::vector<float> spacing_axial = {
         axial_side_length / resolution,
         axial_side_length / resolution};
-    std::vector<float> wwwl_cmpr = {
-        range_cmpr,
-        range_cmpr / 2};
-    std::vector<float> wwwl_axial = {
-        range_axial,
-        range_axial / 2};
-
-    response["metadata"] = metadata;
-    response["pixels_cmpr"] = values_cmpr;
-    response["pixels_axial"] = values_axial;
-    response["dimension_cmpr"] = dimension_cmpr;
-    response["dimension_axial"] = dimension_axial;
-    response["spacing_cmpr"] = spacing_cmpr;
-    response["spacing_axial"] = spacing_axial;
-    response["wwwl_cmpr"] = wwwl_cmpr;
-    response["wwwl_axial"] = wwwl_axial;
-    response["iop_axial"] = iop_axial;
-    response["ipp_axial"] = ipp_axial;
+
+    response.fields["metadata"] = metadata;
+    response.pixels_cmpr = std::move(values_cmpr);
+    response.pixels_axial = std::move(values_axial);
+    response.fields["dimension_cmpr"] = dimension_cmpr;
+    response.fields["dimension_axial"] = dimension_axial;
+    response.fields["spacing_cmpr"] = spacing_cmpr;
+    response.fields["spacing_axial"] = spacing_axial;
+    response.fields["wwwl_cmpr"] = wwwl_cmpr;
+    response.fields["wwwl_axial"] = wwwl_axial;
+    response.fields["iop_axial"] = iop_axial;
+    response.fields["ipp_axial"] = ipp_axial;
+    response.mapping = std::make_shared<CmprMapping>(original_spline, rows, sweep_directions,
+                                                     image_offsets, slice_dimension / double(resolution), -int(resolution / 2), axial_frames);
+    if (viewport)
+    {
+        // the sampled part of the whole cmpr: rows, cols and slices ranges, axial frames are those of its rows
+        response.fields["viewport"] = {view.row_begin, view.row_end, view.col_begin, view.col_end,
+                                       float(view.slice_begin), float(view.slice_end), std::floor(view.row_begin)};
+        response.mapping->SetViewport(view.row_begin + 0.5 * row_step - 0.5, row_step, view.col_begin + 0.5 * col_step - 0.5, col_step);
+    }
+    response.timings = timer.stages;
+
+    if (!options.trace_file.empty())
+    {
+        WriteChromeTrace(options.trace_file, response.timings);
+    }
 
     return response;
 }
 
-std::map<std::string, std::vector<float>> compute_cmpr_stretch(std::string volumeFileName,
-                                                               std::vector<float> seeds,
-                                                               unsigned int resolution,
-                                                               std::vector<int> dir,
-                                                               std::vector<float> stack_direction,
-                                                               float dist_slices,
-                                                               int n_slices,
-                                                               bool render)
+// Sweep distance of a stretched cmpr: the volume extent along the sweep direction
+float GetStretchDistance(const std::vector<float> &metadata, const double direction[3])
+{
+    float distance = 0.0f;
+    // TODO get max direction
+    if (direction[0] == 1.0)
+    {
+        distance = metadata[7] - metadata[6];
+    }
+    else if (direction[1] == 1.0)
+    {
+        distance = metadata[9] - metadata[8];
+    }
+    else if (direction[2] == 1.0)
+    {
+        distance = metadata[11] - metadata[10];
+    }
+    return distance;
+}
+
+// Stretched cmpr, the volume is loaded once the sampled region is known.
+// scalar_range: range of the whole volume, nullptr to use the range of the voxels around the samples (no other page
+// of a mapped volume is read)
+CmprResult ComputeCmprStretch(const VolumeLoader &load,
+                              const std::vector<float> &metadata,
+                              const double *scalar_range,
+                              std::vector<float> seeds,
+                              unsigned int resolution,
+                              std::vector<int> dir,
+                              std::vector<float> stack_direction,
+                              float dist_slices,
+                              int n_slices,
+                              bool render,
+                              const CmprOptions &options)
 {
-    time_t time_0;
-    time(&time_0);
+    CancelScope cancel_scope(options.cancel);
+    StageTimer timer;
 
     // Parse input
     double direction[3];
     std::copy(dir.begin(), dir.end(), direction);
 
-    // Print arguments
-    std::cout << "InputVolume: " << volumeFileName << std::endl;
-
-    // Read the volume data
-    vtkSmartPointer<vtkNrrdReader> reader = vtkSmartPointer<vtkNrrdReader>::New();
-    reader->SetFileName(volumeFileName.c_str());
-    reader->Update();
-
-    std::vector<float> metadata = GetMetadata(reader->GetOutput());
-
     double origin[3] = {
         metadata[0],
         metadata[1],
@@ -169,6 +358,8 @@ std::map<std::string, std::vector<float>> compute_cmpr_stretch(std::string volum
         -direction[2]};
 
     // Recreate source spline
+    CheckCancelled(); // a cancelled request stops between stages, and between blocks of samples
+    timer.Start("spline");
     vtkSmartPointer<vtkPolyData> original_spline = vtkSmartPointer<vtkPolyData>::New();
     original_spline = CreateSpline(seeds, resolution, origin, neg_direction, false);
 
@@ -177,70 +368,102 @@ std::map<std::string, std::vector<float>> compute_cmpr_stretch(std::string volum
     spline = CreateSpline(seeds, resolution, origin, neg_direction, true);
 
     // Compute sweep distance
-    float distance;
-    // TODO get max direction
-    if (direction[0] == 1.0)
-    {
-        distance = metadata[7] - metadata[6];
-    }
-    else if (direction[1] == 1.0)
-    {
-        distance = metadata[9] - metadata[8];
-    }
-    else if (direction[2] == 1.0)
-    {
-        distance = metadata[11] - metadata[10];
-    }
+    float distance = GetStretchDistance(metadata, direction);
 
+    CheckCancelled();
+    timer.Start("sweep");
     vtkSmartPointer<vtkPolyData> master_slice = SweepLineFixedDirection(spline, direction, distance, resolution);
 
-    // Shift the master slice to create a stack
-    std::map<int, vtkSmartPointer<vtkPolyData>> stack_map = CreateStack(master_slice, n_slices, stack_direction, dist_slices);
-
-    // Squash stack map into a single polydata
-    vtkSmartPointer<vtkPolyData> complete_stack = Squash(stack_map, false);
+    // Describe the stack as the master slice plus one offset per slice
+    CheckCancelled();
+    timer.Start("stack");
+    // or the samples across the slab, reduced to a single image
+    ImplicitStack stack = options.slab == SLAB_NONE ? CreateImplicitStack(master_slice, n_slices, stack_direction, dist_slices)
+                                                    : CreateSlab(master_slice, stack_direction, options.slab_thickness, options.slab_samples);
+    int n_images = options.slab == SLAB_NONE ? int(stack.offsets.size() / 3) : 1;
+    std::vector<double> image_offsets = options.slab == SLAB_NONE ? stack.offsets : std::vector<double>(3, 0.0);
 
     // Compute axial stack
+    CheckCancelled();
+    timer.Start("axial");
     float axial_side_length = 120.0;
     std::vector<float> iop_axial;
     std::vector<float> ipp_axial;
-    std::map<int, vtkSmartPointer<vtkPolyData>> axial_stack_map = CreateAxialStack(original_spline, axial_side_length, resolution, iop_axial, ipp_axial);
-
-    // Squash stack map into a single polydata
-    vtkSmartPointer<vtkPolyData> complete_axial_stack = Squash(axial_stack_map, false);
+    AxialFrames axial_frames = CreateAxialFrames(original_spline, axial_side_length, resolution);
+    int n_frames = int(axial_frames.basis.size() / 9);
+    GetAxialIOPIPP(axial_frames, iop_axial, ipp_axial);
+
+    // Load the volume, the region sampled by the stack and the axial planes is known from here
+    CheckCancelled();
+    timer.Start("read");
+    double sample_bounds[6];
+    GetSampleBounds(stack, axial_frames, sample_bounds);
+    vtkSmartPointer<vtkImageData> image = load(sample_bounds);
+    double loaded_range[2];
+    if (!scalar_range)
+    {
+        GetBoundsScalarRange(image, sample_bounds, options.threads, loaded_range);
+        scalar_range = loaded_range;
+    }
 
     // Probe the volume with the extruded surfaces
-    vtkSmartPointer<vtkProbeFilter> sampleVolume = vtkSmartPointer<vtkProbeFilter>::New();
-    sampleVolume->SetInputConnection(1, reader->GetOutputPort());
-    sampleVolume->SetInputData(0, complete_stack);
-    sampleVolume->Update();
-
-    vtkSmartPointer<vtkProbeFilter> sampleVolumeAxial = vtkSmartPointer<vtkProbeFilter>::New();
-    sampleVolumeAxial->SetInputConnection(1, reader->GetOutputPort());
-    sampleVolumeAxial->SetInputData(0, complete_axial_stack);
-    sampleVolumeAxial->Update();
-
-    time_t time_1;
-    time(&time_1);
-
-    std::cout << "Total : " << difftime(time_1, time_0) << "[s]" << std::endl;
-
-    // Get values from probe output
-    std::vector<float> values_cmpr = GetPixelValues(sampleVolume->GetOutput(), false);
-    std::vector<float> values_axial = GetPixelValues(sampleVolumeAxial->GetOutput(), true);
+    int pixel_type = GetPixelType(options, image);
+    PixelBuffer values_cmpr;
+    PixelBuffer values_axial;
+    // range and histogram of the pixels, counted while they are written
+    PixelStats stats_cmpr(scalar_range[0], scalar_range[1]);
+    PixelStats stats_axial(scalar_range[0], scalar_range[1]);
+    vtkSmartPointer<vtkProbeFilter> sampleVolume;
+
+    // Slabs are reduced inside the trilinear sampler
+    if (options.sampler == SAMPLER_TRILINEAR || options.slab != SLAB_NONE)
+    {
+        // Slices are generated on the fly while sampling, the pixels are extracted at once
+        CheckCancelled();
+        timer.Start("probe");
+        values_cmpr = options.slab == SLAB_NONE ? SampleStack(image, stack, pixel_type, options.threads, &stats_cmpr)
+                                                : SampleSlab(image, stack, options.slab, pixel_type, options.threads, &stats_cmpr);
+        values_axial = SampleAxialFrames(image, axial_frames, 0, n_frames, pixel_type, true, options.threads, &stats_axial);
+    }
+    else
+    {
+        // Shift the master slice to create a stack and squash it into a single polydata
+        CheckCancelled();
+        timer.Start("squash");
+        vtkSmartPointer<vtkPolyData> squashed = Squash(CreateStack(master_slice, n_slices, stack_direction, dist_slices), false);
+        vtkSmartPointer<vtkPolyData> axial_planes = AxialFramesToPolyData(axial_frames);
+
+        CheckCancelled();
+        timer.Start("probe");
+        sampleVolume = ProbeImage(image, squashed);
+        vtkSmartPointer<vtkProbeFilter> sampleVolumeAxial = ProbeImage(image, axial_planes);
+
+        // Get values from probe output
+        timer.Start("extract");
+        values_cmpr = GetPixelValues(sampleVolume->GetOutput(), pixel_type, false, &stats_cmpr);
+        values_axial = GetPixelValues(sampleVolumeAxial->GetOutput(), pixel_type, true, &stats_axial);
+    }
 
-    std::map<std::string, std::vector<float>> response;
+    CmprResult response;
 
     // Compute mean distance btw points to be returned as image spacing
+    timer.Start("wwwl");
     float mean_pts_distance = GetMeanDistanceBtwPoints(spline);
-    float range_cmpr = GetWindowWidth(values_cmpr, reader->GetOutput()->GetScalarRange()[1], reader->GetOutput()->GetScalarRange()[0]);
-    float range_axial = GetWindowWidth(values_axial, reader->GetOutput()->GetScalarRange()[1], reader->GetOutput()->GetScalarRange()[0]);
+    std::vector<float> wwwl_cmpr = GetWindowLevel(stats_cmpr, scalar_range, options.wwwl_percentile);
+    std::vector<float> wwwl_axial = GetWindowLevel(stats_axial, scalar_range, options.wwwl_percentile);
+    timer.Stop();
+
+    CMPR_LOG(LOG_INFO, "Total : " << timer.GetElapsedUs() / 1000.0 << " [ms]");
 
 #ifdef DYNAMIC_VMTK
     // Render
     if (render)
     {
-        int res = renderAll(original_spline, sampleVolume, reader->GetOutput(), distance, range_cmpr);
+        if (!sampleVolume)
+        {
+            sampleVolume = ProbeImage(image, Squash(CreateStack(master_slice, n_slices, stack_direction, dist_slices), false));
+        }
+        int res = renderAll(original_spline, sampleVolume, image, distance, wwwl_cmpr[0]);
     }
 #endif
 
@@ -248,33 +471,176 @@ std::map<std::string, std::vector<float>> compute_cmpr_stretch(std::string volum
     std::vector<float> dimension_cmpr = {
         float(seeds.size() / 3),
         float(resolution),
-        GetDimensions(stack_map)[2]};
-    std::vector<float>
-        dimension_axial = GetDimensions(axial_stack_map);
+        float(n_images)};
+    std::vector<float> dimension_axial = {
+        float(resolution + 1),
+        float(resolution + 1),
+        float(n_frames)};
     std::vector<float> spacing_cmpr = {
         float(distance / resolution),
         mean_pts_distance};
     std::vector<float> spacing_axial = {
         axial_side_length / resolution,
         axial_side_length / resolution};
-    std::vector<float> wwwl_cmpr = {
-        range_cmpr,
-        range_cmpr / 2};
-    std::vector<float> wwwl_axial = {
-        range_axial,
-        range_axial / 2};
-
-    response["metadata"] = metadata;
-    response["pixels_cmpr"] = values_cmpr;
-    response["pixels_axial"] = values_axial;
-    response["dimension_cmpr"] = dimension_cmpr;
-    response["dimension_axial"] = dimension_axial;
-    response["spacing_cmpr"] = spacing_cmpr;
-    response["spacing_axial"] = spacing_axial;
-    response["wwwl_cmpr"] = wwwl_cmpr;
-    response["wwwl_axial"] = wwwl_axial;
-    response["iop_axial"] = iop_axial;
-    response["ipp_axial"] = ipp_axial;
+
+    response.fields["metadata"] = metadata;
+    response.pixels_cmpr = std::move(values_cmpr);
+    response.pixels_axial = std::move(values_axial);
+    response.fields["dimension_cmpr"] = dimension_cmpr;
+    response.fields["dimension_axial"] = dimension_axial;
+    response.fields["spacing_cmpr"] = spacing_cmpr;
+    response.fields["spacing_axial"] = spacing_axial;
+    response.fields["wwwl_cmpr"] = wwwl_cmpr;
+    response.fields["wwwl_axial"] = wwwl_axial;
+    response.fields["iop_axial"] = iop_axial;
+    response.fields["ipp_axial"] = ipp_axial;
+
+    // every row of a stretched cmpr is swept along the same direction
+    std::vector<double> row_directions;
+    for (vtkIdType row = 0; row < spline->GetNumberOfPoints(); row++)
+    {
+        row_directions.insert(row_directions.end(), direction, direction + 3);
+    }
+    response.mapping = std::make_shared<CmprMapping>(spline, int(spline->GetNumberOfPoints()), row_directions, image_offsets,
+                                                     double(distance) / resolution, 0, axial_frames);
+    response.timings = timer.stages;
+
+    if (!options.trace_file.empty())
+    {
+        WriteChromeTrace(options.trace_file, response.timings);
+    }
 
     return response;
-}
\ No newline at end of file
+}
+
+// Rotational cmpr: the straightened cmpr seen from n_angles view angles spread over [0, 180) degrees around
+// the centerline. The spline, the smoothed sweep directions and the axial frames are computed once, every
+// angle turns the sweep directions around the curve and the angles are sampled together (always trilinear).
+// pixels_cmpr is angles x rows x cols, angle 0 is the straightened cmpr of the same arguments.
+CmprResult ComputeCmprRotational(const VolumeLoader &load,
+                                 const std::vector<float> &metadata,
+                                 const double *scalar_range,
+                                 std::vector<float> seeds,
+                                 std::vector<float> tng,
+                                 std::vector<float> ptn,
+                                 unsigned int resolution,
+                                 std::vector<int> dir,
+                                 float slice_dimension,
+                                 int n_angles,
+                                 const CmprOptions &options)
+{
+    CancelScope cancel_scope(options.cancel);
+    StageTimer timer;
+
+    // Parse input
+    double direction[3];
+    std::copy(dir.begin(), dir.end(), direction);
+    n_angles = std::max(n_angles, 1);
+
+    double origin[3] = {
+        metadata[0],
+        metadata[1],
+        metadata[2],
+    };
+    double neg_direction[3] = {
+        -direction[0],
+        -direction[1],
+        -direction[2]};
+
+    // Recreate source spline
+    CheckCancelled(); // a cancelled request stops between stages, and between blocks of samples
+    timer.Start("spline");
+    vtkSmartPointer<vtkPolyData> original_spline = CreateSpline(seeds, resolution, origin, neg_direction, false);
+
+    // Smoothed sweep directions, turned once per angle
+    CheckCancelled();
+    timer.Start("sweep");
+    std::vector<float> angles;
+    std::vector<double> angles_degrees;
+    for (int a = 0; a < n_angles; a++)
+    {
+        angles_degrees.push_back(180.0 * a / n_angles);
+        angles.push_back(float(angles_degrees.back()));
+    }
+    std::vector<double> directions = RotateSweepDirections(original_spline,
+                                                           GetSweepDirections(original_spline, ptn, slice_dimension),
+                                                           angles_degrees);
+
+    // Compute axial stack
+    CheckCancelled();
+    timer.Start("axial");
+    float axial_side_length = 120.0;
+    std::vector<float> iop_axial;
+    std::vector<float> ipp_axial;
+    AxialFrames axial_frames = CreateAxialFrames(original_spline, axial_side_length, resolution);
+    int n_frames = int(axial_frames.basis.size() / 9);
+    GetAxialIOPIPP(axial_frames, iop_axial, ipp_axial);
+
+    // Load the volume: every rotated surface lies within half its width of the spline
+    CheckCancelled();
+    timer.Start("read");
+    ImplicitStack reach;
+    reach.points = original_spline->GetPoints();
+    for (int a = 0; a < 3; a++)
+    {
+        for (int side = -1; side <= 1; side += 2)
+        {
+            double offset[3] = {0.0, 0.0, 0.0};
+            offset[a] = side * slice_dimension / 2.0;
+            reach.offsets.insert(reach.offsets.end(), offset, offset + 3);
+        }
+    }
+    double sample_bounds[6];
+    GetSampleBounds(reach, axial_frames, sample_bounds);
+    vtkSmartPointer<vtkImageData> image = load(sample_bounds);
+    double loaded_range[2];
+    if (!scalar_range)
+    {
+        GetBoundsScalarRange(image, sample_bounds, options.threads, loaded_range);
+        scalar_range = loaded_range;
+    }
+
+    // Sample every angle and the axial frames
+    CheckCancelled();
+    timer.Start("probe");
+    int pixel_type = GetPixelType(options, image);
+    PixelStats stats_cmpr(scalar_range[0], scalar_range[1]);
+    PixelStats stats_axial(scalar_range[0], scalar_range[1]);
+    PixelBuffer values_cmpr = SampleRotational(image, original_spline, directions, slice_dimension, int(resolution),
+                                               pixel_type, options.threads, &stats_cmpr);
+    PixelBuffer values_axial = SampleAxialFrames(image, axial_frames, 0, n_frames, pixel_type, true, options.threads, &stats_axial);
+
+    CmprResult response;
+
+    timer.Start("wwwl");
+    float mean_pts_distance = GetMeanDistanceBtwPoints(original_spline);
+    std::vector<float> wwwl_cmpr = GetWindowLevel(stats_cmpr, scalar_range, options.wwwl_percentile);
+    std::vector<float> wwwl_axial = GetWindowLevel(stats_axial, scalar_range, options.wwwl_percentile);
+    timer.Stop();
+
+    CMPR_LOG(LOG_INFO, "Total : " << timer.GetElapsedUs() / 1000.0 << " [ms]");
+
+    // Compose response with metadata
+    response.fields["metadata"] = metadata;
+    response.pixels_cmpr = std::move(values_cmpr);
+    response.pixels_axial = std::move(values_axial);
+    response.fields["dimension_cmpr"] = {float(seeds.size() / 3 - 1), float(resolution), float(n_angles)};
+    response.fields["dimension_axial"] = {float(resolution + 1), float(resolution + 1), float(n_frames)};
+    response.fields["spacing_cmpr"] = {slice_dimension / float(resolution), mean_pts_distance};
+    response.fields["spacing_axial"] = {axial_side_length / resolution, axial_side_length / resolution};
+    response.fields["wwwl_cmpr"] = wwwl_cmpr;
+    response.fields["wwwl_axial"] = wwwl_axial;
+    response.fields["iop_axial"] = iop_axial;
+    response.fields["ipp_axial"] = ipp_axial;
+    response.fields["angles"] = angles;
+    response.mapping = std::make_shared<CmprMapping>(original_spline, int(original_spline->GetNumberOfPoints()) - 1, directions,
+                                                     std::vector<double>(), slice_dimension / double(resolution), -int(resolution / 2), axial_frames);
+    response.timings = timer.stages;
+
+    if (!options.trace_file.empty())
+    {
+        WriteChromeTrace(options.trace_file, response.timings);
+    }
+
+    return response;
+}
@@ -70,45 +70,166 @@ vtkSmartPointer<vtkPolyData> CreateSpline(std::vector<float> seeds, int resoluti
   // return spline->GetOutput();
 }
 
-// Extrude a spline to create a curved plane
-vtkSmartPointer<vtkPolyData> SweepLine(vtkPolyData *line, std::vector<float> directions, double distance, int cols)
+// Unit tangent of the line at point i (central difference, one-sided at the ends)
+void GetLineTangent(vtkPolyData *line, vtkIdType i, double tangent[3])
+{
+  vtkIdType n = line->GetNumberOfPoints();
+  double p0[3], p1[3];
+  line->GetPoint(std::max(i - 1, vtkIdType(0)), p0);
+  line->GetPoint(std::min(i + 1, n - 1), p1);
+  vtkMath::Subtract(p1, p0, tangent);
+  vtkMath::Normalize(tangent);
+}
+
+// Smooth the sweep directions along the curve with a moving average over 2 * radius + 1 rows
+// (prefix sums, linear time whatever the radius), then make them unit vectors orthogonal to the curve
+std::vector<double> SmoothSweepDirections(vtkPolyData *line, const std::vector<float> &directions, unsigned int rows, int radius)
+{
+  std::vector<double> smoothed(3 * rows);
+  std::vector<double> prefix(3 * (rows + 1), 0.0);
+
+  for (unsigned int row = 0; row < rows; row++)
+  {
+    for (int a = 0; a < 3; a++)
+    {
+      prefix[3 * (row + 1) + a] = prefix[3 * row + a] + directions[3 * row + a];
+    }
+  }
+
+  for (unsigned int row = 0; row < rows; row++)
+  {
+    int first = std::max(int(row) - radius, 0);
+    int last = std::min(int(row) + radius, int(rows) - 1);
+    double d[3], t[3];
+    for (int a = 0; a < 3; a++)
+    {
+      d[a] = (prefix[3 * (last + 1) + a] - prefix[3 * first + a]) / (last - first + 1);
+    }
+
+    // remove the component along the curve
+    GetLineTangent(line, row, t);
+    double dt = vtkMath::Dot(d, t);
+    for (int a = 0; a < 3; a++)
+    {
+      d[a] -= dt * t[a];
+    }
+
+    // degenerate direction: keep the previous row one
+    if (vtkMath::Normalize(d) == 0.0 && row > 0)
+    {
+      std::copy(&smoothed[3 * (row - 1)], &smoothed[3 * row], d);
+    }
+    std::copy(d, d + 3, &smoothed[3 * row]);
+  }
+
+  return smoothed;
+}
+
+// Count the rows where the sweep segment of the next row crosses the current one within half_width,
+// ie. where the surface folds on itself. The sweep is linear along the segment, checking its ends is enough.
+int CountFolds(vtkPolyData *line, const std::vector<double> &directions, unsigned int rows, double half_width)
+{
+  int folds = 0;
+  double p0[3], p1[3], t[3];
+
+  for (unsigned int row = 0; row + 1 < rows; row++)
+  {
+    line->GetPoint(row, p0);
+    line->GetPoint(row + 1, p1);
+    vtkMath::Subtract(p1, p0, t);
+    double step = vtkMath::Normalize(t);
+
+    // advance along the curve of the segment ends
+    double d0 = vtkMath::Dot(&directions[3 * row], t);
+    double d1 = vtkMath::Dot(&directions[3 * (row + 1)], t);
+    if (step + half_width * (d1 - d0) <= 0.0 || step - half_width * (d1 - d0) <= 0.0)
+    {
+      folds++;
+    }
+  }
+
+  return folds;
+}
+
+// Sweep direction of each row: the parallel transport normals, smoothed until the swept surface does not fold any more
+std::vector<double> GetSweepDirections(vtkPolyData *line, const std::vector<float> &directions, double distance)
 {
   unsigned int rows = line->GetNumberOfPoints() - 1; // we use n-1 pts in axial stack
-  double spacing = distance / cols;
 
-  std::cout
-      << "rows, cols: " << rows << ", " << cols << std::endl;
+  int radius = 2;
+  std::vector<double> smoothed = SmoothSweepDirections(line, directions, rows, radius);
+  int folds = CountFolds(line, smoothed, rows, distance / 2);
+  while (folds > 0 && radius < int(rows))
+  {
+    radius *= 2;
+    smoothed = SmoothSweepDirections(line, directions, rows, radius);
+    folds = CountFolds(line, smoothed, rows, distance / 2);
+  }
+  if (folds > 0)
+  {
+    CMPR_LOG(LOG_WARNING, "swept surface folds at " << folds << " rows");
+  }
 
-  vtkSmartPointer<vtkPolyData> surface = vtkSmartPointer<vtkPolyData>::New();
+  return smoothed;
+}
 
-  // Generate the points
-  // cols++; TODO evaluate if necessary
-  unsigned int numberOfPoints = rows * cols;
-  unsigned int numberOfPolys = (rows - 1) * (cols - 1);
-  vtkSmartPointer<vtkPoints> points =
-      vtkSmartPointer<vtkPoints>::New();
-  points->Allocate(numberOfPoints);
-  vtkSmartPointer<vtkCellArray> polys =
-      vtkSmartPointer<vtkCellArray>::New();
-  polys->Allocate(numberOfPolys * 4);
+// Points of rows [row_begin, row_end) of the swept surface, stored as floats like vtkPoints does
+void SweepRows(vtkPolyData *line, const std::vector<double> &directions, double distance, int cols,
+               unsigned int row_begin, unsigned int row_end, float *points)
+{
+  double spacing = distance / cols;
+  double p[3];
+  const double *direction;
+  float *x = points + 3 * row_begin * cols;
 
-  double x[3], direction[3];
-  unsigned int cnt = 0;
-  for (unsigned int row = 0; row < rows; row++)
+  for (unsigned int row = row_begin; row < row_end; row++)
   {
-    for (int col = -cols / 2; col < cols / 2; col++)
+    line->GetPoint(row, p);
+    direction = &directions[3 * row];
+    for (int c = 0; c < cols; c++, x += 3)
     {
-      double p[3];
-      line->GetPoint(row, p);
-      direction[0] = directions[row * 3];
-      direction[1] = directions[row * 3 + 1];
-      direction[2] = directions[row * 3 + 2];
+      int col = c - cols / 2;
       x[0] = p[0] + direction[0] * col * spacing;
       x[1] = p[1] + direction[1] * col * spacing;
       x[2] = p[2] + direction[2] * col * spacing;
-      points->InsertPoint(cnt++, x);
     }
   }
+}
+
+// Extrude a spline to create a curved plane
+vtkSmartPointer<vtkPolyData> SweepLine(vtkPolyData *line, std::vector<float> directions, double distance, int cols)
+{
+  return SweepSurface(line, GetSweepDirections(line, directions, distance), distance, cols);
+}
+
+// Curved plane of a spline swept along already smoothed directions (GetSweepDirections)
+vtkSmartPointer<vtkPolyData> SweepSurface(vtkPolyData *line, const std::vector<double> &smoothed, double distance, int cols)
+{
+  unsigned int rows = line->GetNumberOfPoints() - 1; // we use n-1 pts in axial stack
+
+  CMPR_LOG(LOG_DEBUG, "rows, cols: " << rows << ", " << cols);
+
+  // Generate the points on a regular rows x cols grid
+  vtkSmartPointer<vtkPoints> points =
+      vtkSmartPointer<vtkPoints>::New();
+  points->SetDataTypeToFloat();
+  points->SetNumberOfPoints(rows * cols);
+
+  SweepRows(line, smoothed, distance, cols, 0, rows, static_cast<float *>(points->GetVoidPointer(0)));
+
+  return CreateGridSurface(points, rows, cols);
+}
+
+// Surface of points on a regular rows x cols grid, one quad per grid cell
+vtkSmartPointer<vtkPolyData> CreateGridSurface(vtkPoints *points, unsigned int rows, unsigned int cols)
+{
+  vtkSmartPointer<vtkPolyData> surface = vtkSmartPointer<vtkPolyData>::New();
+
+  unsigned int numberOfPolys = (rows - 1) * (cols - 1);
+  vtkSmartPointer<vtkCellArray> polys =
+      vtkSmartPointer<vtkCellArray>::New();
+  polys->Allocate(numberOfPolys * 4);
+
   // Generate the quads
   vtkIdType pts[4];
   for (unsigned int row = 0; row < rows - 1; row++)
@@ -125,27 +246,95 @@ vtkSmartPointer<vtkPolyData> SweepLine(vtkPolyData *line, std::vector<float> dir
   surface->SetPoints(points);
   surface->SetPolys(polys);
 
-  vtkSmartPointer<vtkTriangleFilter> triangleFilter =
-      vtkSmartPointer<vtkTriangleFilter>::New();
-  triangleFilter->SetInputData(surface);
-  triangleFilter->Update();
-
-  // TODO test with c++ interface (not pybind)
-  // vtkSmartPointer<vtkvmtkPolyDataKiteRemovalFilter> kiteRemovalFilter = vtkSmartPointer<vtkvmtkPolyDataKiteRemovalFilter>::New();
-  // kiteRemovalFilter->SetInputConnection(triangleFilter->GetOutputPort());
-  // kiteRemovalFilter->SetSizeFactor(2);
-  // kiteRemovalFilter->Update();
-
-  vtkSmartPointer<vtkSmoothPolyDataFilter> smoothFilter =
-      vtkSmartPointer<vtkSmoothPolyDataFilter>::New();
-  smoothFilter->SetInputData(triangleFilter->GetOutput());
-  smoothFilter->SetNumberOfIterations(1000); // opt param
-  smoothFilter->SetRelaxationFactor(0.1);    // opt param
-  smoothFilter->FeatureEdgeSmoothingOff();
-  smoothFilter->BoundarySmoothingOn();
-  smoothFilter->Update();
-
-  return smoothFilter->GetOutput();
+  return surface;
+}
+
+// Viewport of a cmpr of rows x cols x n_images pixels with every range and the output size set, clamped to the cmpr
+CmprViewport ResolveViewport(const CmprViewport &viewport, int rows, int cols, int n_images)
+{
+  CmprViewport view = viewport;
+  if (view.row_end <= view.row_begin)
+  {
+    view.row_begin = 0.0f;
+    view.row_end = float(rows);
+  }
+  if (view.col_end <= view.col_begin)
+  {
+    view.col_begin = 0.0f;
+    view.col_end = float(cols);
+  }
+  if (view.slice_end <= view.slice_begin)
+  {
+    view.slice_begin = 0;
+    view.slice_end = n_images;
+  }
+
+  view.row_begin = std::max(view.row_begin, 0.0f);
+  view.row_end = std::min(view.row_end, float(rows));
+  view.col_begin = std::max(view.col_begin, 0.0f);
+  view.col_end = std::min(view.col_end, float(cols));
+  view.slice_begin = std::max(view.slice_begin, 0);
+  view.slice_end = std::min(view.slice_end, n_images);
+  if (view.row_end <= view.row_begin || view.col_end <= view.col_begin || view.slice_end <= view.slice_begin)
+  {
+    throw std::invalid_argument("viewport outside of the cmpr");
+  }
+
+  if (view.out_rows == 0)
+  {
+    view.out_rows = std::max(unsigned(std::lround(view.row_end - view.row_begin)), 1u);
+  }
+  if (view.out_cols == 0)
+  {
+    view.out_cols = std::max(unsigned(std::lround(view.col_end - view.col_begin)), 1u);
+  }
+
+  return view;
+}
+
+// Part of the swept surface in a resolved viewport, out_rows x out_cols points at the pixel centers. Between the
+// rows of the spline the surface is interpolated, as the mapping of the response does.
+vtkSmartPointer<vtkPolyData> SweepViewport(vtkPolyData *line, const std::vector<double> &directions, double distance, int cols,
+                                           const CmprViewport &view)
+{
+  int rows = int(line->GetNumberOfPoints()) - 1; // we use n-1 pts in axial stack
+  double spacing = distance / cols;
+  double row_step = double(view.row_end - view.row_begin) / view.out_rows;
+  double col_step = double(view.col_end - view.col_begin) / view.out_cols;
+
+  CMPR_LOG(LOG_DEBUG, "viewport rows, cols: " << view.out_rows << ", " << view.out_cols);
+
+  vtkSmartPointer<vtkPoints> points =
+      vtkSmartPointer<vtkPoints>::New();
+  points->SetDataTypeToFloat();
+  points->SetNumberOfPoints(vtkIdType(view.out_rows) * view.out_cols);
+  float *x = static_cast<float *>(points->GetVoidPointer(0));
+
+  for (unsigned int i = 0; i < view.out_rows; i++)
+  {
+    double row = std::min(std::max(view.row_begin + (i + 0.5) * row_step - 0.5, 0.0), double(rows - 1));
+    int r0 = int(row);
+    int r1 = std::min(r0 + 1, rows - 1);
+    double f = row - r0;
+    double p0[3], p1[3];
+    line->GetPoint(r0, p0);
+    line->GetPoint(r1, p1);
+    const double *d0 = &directions[3 * r0];
+    const double *d1 = &directions[3 * r1];
+
+    for (unsigned int j = 0; j < view.out_cols; j++, x += 3)
+    {
+      double col = (view.col_begin + (j + 0.5) * col_step - 0.5 - cols / 2) * spacing;
+      for (int a = 0; a < 3; a++)
+      {
+        double x0 = p0[a] + d0[a] * col;
+        double x1 = p1[a] + d1[a] * col;
+        x[a] = float(x0 + f * (x1 - x0));
+      }
+    }
+  }
+
+  return CreateGridSurface(points, view.out_rows, view.out_cols);
 }
 
 // Extrude a spline to create a curved plane
@@ -154,7 +343,7 @@ vtkSmartPointer<vtkPolyData> SweepLineFixedDirection(vtkPolyData *line, double d
   unsigned int rows = line->GetNumberOfPoints();
   double spacing = distance / cols;
 
-  std::cout << "rows, cols: " << rows << ", " << cols << std::endl;
+  CMPR_LOG(LOG_DEBUG, "rows, cols: " << rows << ", " << cols);
 
   vtkSmartPointer<vtkPolyData> surface = vtkSmartPointer<vtkPolyData>::New();
 
@@ -222,88 +411,101 @@ vtkSmartPointer<vtkPolyData> ShiftMasterSlice(vtkPolyData *original_surface, int
   return transformFilter->GetOutput();
 }
 
-void GetIOPIPP(vtkSmartPointer<vtkPlaneSource> slice, double iop[6], double ipp[3])
+// Rotate v around a unit axis by theta radians (Rodrigues formula)
+void RotateVector(double v[3], const double axis[3], double theta)
 {
-  double p0[3], p1[3], p2[3], v01[3], v02[3];
-
-  slice->GetOrigin(ipp);
-  slice->GetPoint1(p1);
-  slice->GetPoint2(p2);
-
-  // std::cout << slice->GetOrigin()[0] << ", "
-  //           << slice->GetOrigin()[1] << ", "
-  //           << slice->GetOrigin()[2] << std::endl;
-  // std::cout << slice->GetPoint1()[0] << ", "
-  //           << slice->GetPoint1()[1] << ", "
-  //           << slice->GetPoint1()[2] << std::endl;
-  // std::cout << slice->GetPoint2()[0] << ", "
-  //           << slice->GetPoint2()[1] << ", "
-  //           << slice->GetPoint2()[2] << std::endl;
-
-  vtkMath::Subtract(p1, ipp, v01);
-  vtkMath::Normalize(v01);
-  vtkMath::Subtract(p2, ipp, v02);
-  vtkMath::Normalize(v02);
-
-  // std::cout << v01[0] << ", "
-  //           << v01[1] << ", "
-  //           << v01[2] << std::endl;
-
-  // std::cout << v02[0] << ", "
-  //           << v02[1] << ", "
-  //           << v02[2] << std::endl;
-
-  // std::cout << " --- " << std::endl;
-
-  iop[0] = v01[0];
-  iop[1] = v01[1];
-  iop[2] = v01[2];
-  iop[3] = v02[0];
-  iop[4] = v02[1];
-  iop[5] = v02[2];
-
-  return;
+  double c = cos(theta);
+  double s = sin(theta);
+  double kxv[3];
+  vtkMath::Cross(axis, v, kxv);
+  double kv = vtkMath::Dot(axis, v) * (1.0 - c);
+
+  for (int a = 0; a < 3; a++)
+  {
+    v[a] = v[a] * c + kxv[a] * s + axis[a] * kv;
+  }
 }
 
-vtkSmartPointer<vtkPolyData> GetOrientedPlane(double origin[3], double normal[3], float side_length, int resolution, std::vector<float> &iop_axial, std::vector<float> &ipp_axial)
+// Sweep directions of every row turned around the curve tangent, rows of the first angle first.
+// Angles in degrees, angle 0 gives back the directions.
+std::vector<double> RotateSweepDirections(vtkPolyData *line, const std::vector<double> &directions, const std::vector<double> &angles)
 {
+  size_t rows = directions.size() / 3;
+  std::vector<double> rotated(3 * rows * angles.size());
+  double t[3];
 
+  for (size_t row = 0; row < rows; row++)
+  {
+    GetLineTangent(line, row, t);
+    for (size_t a = 0; a < angles.size(); a++)
+    {
+      double *d = &rotated[3 * (a * rows + row)];
+      std::copy(&directions[3 * row], &directions[3 * row] + 3, d);
+      RotateVector(d, t, vtkMath::RadiansFromDegrees(angles[a]));
+    }
+  }
+
+  return rotated;
+}
+
+// Same rotation as vtkPlaneSource::SetNormal, applied to the plane edges v1, v2 and its normal
+void SetPlaneNormal(double v1[3], double v2[3], double normal[3], const double new_normal[3])
+{
+  double n[3] = {new_normal[0], new_normal[1], new_normal[2]};
+  double axis[3];
+  double theta;
+
+  // zero normals are rejected
+  if (vtkMath::Normalize(n) == 0.0)
+  {
+    return;
+  }
+
+  double dp = vtkMath::Dot(normal, n);
+  if (dp >= 1.0)
+  {
+    return;
+  }
+  else if (dp <= -1.0)
+  {
+    theta = vtkMath::Pi();
+    std::copy(v1, v1 + 3, axis);
+  }
+  else
+  {
+    vtkMath::Cross(normal, n, axis);
+    theta = acos(dp);
+  }
+  vtkMath::Normalize(axis);
+
+  RotateVector(v1, axis, theta);
+  RotateVector(v2, axis, theta);
+  std::copy(n, n + 3, normal);
+}
+
+// Orientation of an axial plane centered on a spline point: same plane vtkPlaneSource gives
+// after setting the normal along z, yz and xyz, as ipp (first corner) and unit edge vectors u, v
+void GetAxialBasis(const double center[3], const double normal[3], float side_length, double ipp[3], double u[3], double v[3])
+{
   double normal_z[3] = {0, 0, normal[2]};
-  vtkMath::Normalize(normal_z);
   double normal_yz[3] = {0, normal[1], normal[2]};
-  vtkMath::Normalize(normal_yz);
   double normal_xyz[3] = {normal[0], normal[1], normal[2]};
-  vtkMath::Normalize(normal_xyz);
-
-  vtkSmartPointer<vtkPlaneSource>
-      targetPlane = vtkSmartPointer<vtkPlaneSource>::New();
-  targetPlane->SetOrigin(0.0, 0.0, 0.0);
-  targetPlane->SetPoint1(side_length, 0.0, 0.0);
-  targetPlane->SetPoint2(0.0, side_length, 0.0);
-  targetPlane->SetNormal(normal_z);
-  targetPlane->SetNormal(normal_yz);
-  targetPlane->SetNormal(normal_xyz);
-  targetPlane->SetCenter(origin);
-  targetPlane->SetXResolution(resolution);
-  targetPlane->SetYResolution(resolution);
-  targetPlane->Update();
-
-  double iop[6];
-  double ipp[3];
-  GetIOPIPP(targetPlane, iop, ipp);
-
-  iop_axial.push_back(iop[0]);
-  iop_axial.push_back(iop[1]);
-  iop_axial.push_back(iop[2]);
-  iop_axial.push_back(iop[3]);
-  iop_axial.push_back(iop[4]);
-  iop_axial.push_back(iop[5]);
-
-  ipp_axial.push_back(ipp[0]);
-  ipp_axial.push_back(ipp[1]);
-  ipp_axial.push_back(ipp[2]);
-
-  return targetPlane->GetOutput();
+
+  double plane_normal[3] = {0.0, 0.0, 1.0};
+  double v1[3] = {side_length, 0.0, 0.0};
+  double v2[3] = {0.0, side_length, 0.0};
+  SetPlaneNormal(v1, v2, plane_normal, normal_z);
+  SetPlaneNormal(v1, v2, plane_normal, normal_yz);
+  SetPlaneNormal(v1, v2, plane_normal, normal_xyz);
+
+  for (int a = 0; a < 3; a++)
+  {
+    ipp[a] = center[a] - 0.5 * v1[a] - 0.5 * v2[a];
+    u[a] = v1[a];
+    v[a] = v2[a];
+  }
+  vtkMath::Normalize(u);
+  vtkMath::Normalize(v);
 }
 
 double GetMeanDistanceBtwPoints(vtkSmartPointer<vtkPolyData> spline)
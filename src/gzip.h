@@ -0,0 +1,252 @@
+// Input bytes per member written by DeflateGzipMembers, as bgzip: a compressed member always fits in 64 KiB
+const size_t GZIP_BLOCK_SIZE = 65280;
+
+// A gzip member of a multi-member stream and the place of its inflated bytes in the output
+struct GzipMember
+{
+  size_t offset;
+  size_t size;
+  size_t output_offset;
+  size_t output_size;
+};
+
+unsigned int GetLittleEndian32(const unsigned char *bytes)
+{
+  return unsigned(bytes[0]) | unsigned(bytes[1]) << 8 | unsigned(bytes[2]) << 16 | unsigned(bytes[3]) << 24;
+}
+
+void SetLittleEndian32(unsigned char *bytes, unsigned int value)
+{
+  for (int b = 0; b < 4; b++)
+  {
+    bytes[b] = (unsigned char)(value >> (8 * b));
+  }
+}
+
+// Members of a BGZF-like stream: every member records its own size in a "BC" extra field, so they are found
+// without inflating anything. Empty if any member lacks it (plain gzip, single member).
+std::vector<GzipMember> GetGzipMembers(const unsigned char *data, size_t size)
+{
+  std::vector<GzipMember> members;
+  size_t offset = 0;
+  size_t output_offset = 0;
+
+  while (offset < size)
+  {
+    const unsigned char *member = data + offset;
+    // magic, deflate method and extra field flag
+    if (size - offset < 18 || member[0] != 0x1f || member[1] != 0x8b || member[2] != 8 || !(member[3] & 4))
+    {
+      return std::vector<GzipMember>();
+    }
+
+    size_t extra_size = member[10] | member[11] << 8;
+    if (12 + extra_size > size - offset)
+    {
+      return std::vector<GzipMember>();
+    }
+
+    size_t member_size = 0;
+    for (size_t e = 12; e + 4 <= 12 + extra_size; e += 4 + (member[e + 2] | member[e + 3] << 8))
+    {
+      if (member[e] == 'B' && member[e + 1] == 'C' && (member[e + 2] | member[e + 3] << 8) == 2 && e + 6 <= 12 + extra_size)
+      {
+        member_size = size_t(member[e + 4] | member[e + 5] << 8) + 1;
+      }
+    }
+    if (member_size < 12 + extra_size + 8 || member_size > size - offset)
+    {
+      return std::vector<GzipMember>();
+    }
+
+    // the trailer ends with the inflated size
+    size_t output_size = GetLittleEndian32(member + member_size - 4);
+    members.push_back({offset, member_size, output_offset, output_size});
+    offset += member_size;
+    output_offset += output_size;
+  }
+
+  return members;
+}
+
+// Inflate a gzip stream (one or more concatenated members) into out until it is full,
+// false if the stream is corrupted or too short
+bool InflateGzipStream(const unsigned char *data, size_t size, unsigned char *out, size_t out_size)
+{
+  z_stream stream = z_stream();
+  if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+  {
+    return false;
+  }
+
+  // zlib counts in 32 bits, large streams are fed in chunks
+  const size_t chunk = size_t(1) << 30;
+  size_t in_done = 0;
+  size_t out_done = 0;
+  while (out_done < out_size)
+  {
+    stream.next_in = const_cast<unsigned char *>(data + in_done);
+    stream.avail_in = uInt(std::min(size - in_done, chunk));
+    stream.next_out = out + out_done;
+    stream.avail_out = uInt(std::min(out_size - out_done, chunk));
+    uInt avail_in = stream.avail_in;
+    uInt avail_out = stream.avail_out;
+
+    int status = inflate(&stream, Z_NO_FLUSH);
+    in_done += avail_in - stream.avail_in;
+    out_done += avail_out - stream.avail_out;
+
+    if (status == Z_STREAM_END)
+    {
+      // next member
+      if (in_done == size || inflateReset(&stream) != Z_OK)
+      {
+        break;
+      }
+    }
+    else if (status != Z_OK)
+    {
+      break;
+    }
+  }
+
+  inflateEnd(&stream);
+  return out_done == out_size;
+}
+
+// Inflate the first out_size bytes of a gzip stream chunk by chunk, sink(offset, bytes, n) receives them in order.
+// Used when only parts of the inflated data are kept, false if the stream is corrupted or too short.
+bool InflateGzipChunks(const unsigned char *data, size_t size, size_t out_size,
+                       const std::function<void(size_t, const unsigned char *, size_t)> &sink)
+{
+  z_stream stream = z_stream();
+  if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+  {
+    return false;
+  }
+
+  std::vector<unsigned char> chunk(std::min(out_size, size_t(1) << 20));
+  const size_t in_chunk = size_t(1) << 30;
+  size_t in_done = 0;
+  size_t out_done = 0;
+  while (out_done < out_size)
+  {
+    stream.next_in = const_cast<unsigned char *>(data + in_done);
+    stream.avail_in = uInt(std::min(size - in_done, in_chunk));
+    stream.next_out = chunk.data();
+    stream.avail_out = uInt(std::min(out_size - out_done, chunk.size()));
+    uInt avail_in = stream.avail_in;
+    uInt avail_out = stream.avail_out;
+
+    int status = inflate(&stream, Z_NO_FLUSH);
+    in_done += avail_in - stream.avail_in;
+    size_t n = avail_out - stream.avail_out;
+    if (n > 0)
+    {
+      sink(out_done, chunk.data(), n);
+      out_done += n;
+    }
+
+    if (status == Z_STREAM_END)
+    {
+      // next member
+      if (in_done == size || inflateReset(&stream) != Z_OK)
+      {
+        break;
+      }
+    }
+    else if (status != Z_OK)
+    {
+      break;
+    }
+  }
+
+  inflateEnd(&stream);
+  return out_done == out_size;
+}
+
+// Inflate a gzip stream into out (out_size bytes). BGZF-like members are inflated in parallel, each one
+// straight into its place in out, so no decoded copy is made; other streams are inflated serially.
+bool InflateGzip(const unsigned char *data, size_t size, unsigned char *out, size_t out_size, int n_threads)
+{
+  std::vector<GzipMember> members = GetGzipMembers(data, size);
+  if (members.size() < 2)
+  {
+    return InflateGzipStream(data, size, out, out_size);
+  }
+  if (members.back().output_offset + members.back().output_size != out_size)
+  {
+    return false;
+  }
+
+  std::atomic<bool> inflated(true);
+  ParallelFor(int(members.size()), n_threads, [&](int m) {
+    const GzipMember &member = members[m];
+    if (!InflateGzipStream(data + member.offset, member.size, out + member.output_offset, member.output_size))
+    {
+      inflated = false;
+    }
+  });
+
+  return inflated;
+}
+
+// One BGZF-like gzip member: gzip header with the member size in a "BC" extra field, raw deflate data, crc and size
+std::vector<unsigned char> DeflateGzipMember(const unsigned char *data, size_t size, int level)
+{
+  z_stream stream = z_stream();
+  if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    throw std::runtime_error("gzip compression failed");
+  }
+
+  std::vector<unsigned char> member(18 + deflateBound(&stream, uLong(size)) + 8);
+  stream.next_in = const_cast<unsigned char *>(data);
+  stream.avail_in = uInt(size);
+  stream.next_out = &member[18];
+  stream.avail_out = uInt(member.size() - 26);
+  int status = deflate(&stream, Z_FINISH);
+  size_t deflated = stream.total_out;
+  deflateEnd(&stream);
+
+  member.resize(18 + deflated + 8);
+  if (status != Z_STREAM_END || member.size() > 65536)
+  {
+    throw std::runtime_error("gzip compression failed");
+  }
+
+  const unsigned char header[18] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0};
+  std::copy(header, header + 18, member.begin());
+  member[16] = (unsigned char)((member.size() - 1) & 0xff);
+  member[17] = (unsigned char)((member.size() - 1) >> 8);
+
+  SetLittleEndian32(&member[18 + deflated], unsigned(crc32(crc32(0L, Z_NULL, 0), data, uInt(size))));
+  SetLittleEndian32(&member[18 + deflated + 4], unsigned(size));
+
+  return member;
+}
+
+// Deflate data as BGZF-like members of GZIP_BLOCK_SIZE bytes, the members are compressed in parallel.
+// The stream is a valid multi-member gzip stream for any gzip reader.
+// Members are deflated and written by windows of a few members per thread, so that only one window of
+// compressed members is held at a time.
+void DeflateGzipMembers(std::ostream &stream, const unsigned char *data, size_t size, int level, int n_threads)
+{
+  size_t n_members = (size + GZIP_BLOCK_SIZE - 1) / GZIP_BLOCK_SIZE;
+  size_t window = 4 * size_t(n_threads > 0 ? n_threads : GetHardwareThreads());
+  std::vector<std::vector<unsigned char>> members(std::min(window, n_members));
+
+  for (size_t first = 0; first < n_members; first += window)
+  {
+    size_t count = std::min(window, n_members - first);
+    ParallelFor(int(count), n_threads, [&](int m) {
+      size_t begin = (first + m) * GZIP_BLOCK_SIZE;
+      members[m] = DeflateGzipMember(data + begin, std::min(GZIP_BLOCK_SIZE, size - begin), level);
+    });
+
+    for (size_t m = 0; m < count; m++)
+    {
+      stream.write(reinterpret_cast<const char *>(members[m].data()), std::streamsize(members[m].size()));
+    }
+  }
+}
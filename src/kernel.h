@@ -0,0 +1,581 @@
+// Index space of a regular image grid, used to interpolate straight on the scalar buffer
+template <class TScalar>
+struct ImageGrid
+{
+  const TScalar *scalars;
+  double origin[3];
+  double inv_spacing[3];
+  int offset[3];    // lower extent, index of the first stored sample
+  int max_index[3]; // dimensions - 1
+  vtkIdType inc[3]; // memory increments, in scalars
+  vtkIdType step[3]; // increment to the second corner of a cell, 0 along flat axes
+  bool bricked;
+  std::vector<vtkIdType> address[3]; // bricked layout: memory offset of each index along each axis,
+                                     // sample (i, j, k) is at address[0][i] + address[1][j] + address[2][k]
+};
+
+// Bricked layout: the samples are stored in bricks of BRICK_SIZE^3, x fastest inside a brick and across bricks
+const int BRICK_SHIFT = 3;
+const int BRICK_SIZE = 1 << BRICK_SHIFT;
+
+// Address tables of the bricked layout, a brick is contiguous in memory
+void GetBrickAddresses(const int dims[3], std::vector<vtkIdType> address[3])
+{
+  vtkIdType brick_inc = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+  vtkIdType inc = 1;
+  for (int a = 0; a < 3; a++)
+  {
+    address[a].resize(dims[a] + 1);
+    for (int i = 0; i < dims[a]; i++)
+    {
+      address[a][i] = (i >> BRICK_SHIFT) * brick_inc + (i & (BRICK_SIZE - 1)) * inc;
+    }
+    address[a][dims[a]] = address[a][dims[a] - 1]; // the second corner of a flat axis
+    brick_inc *= (dims[a] + BRICK_SIZE - 1) / BRICK_SIZE;
+    inc *= BRICK_SIZE;
+  }
+}
+
+template <class TScalar>
+ImageGrid<TScalar> GetImageGrid(vtkImageData *image)
+{
+  ImageGrid<TScalar> grid;
+  int *extent = image->GetExtent();
+  int components = image->GetNumberOfScalarComponents();
+  int dims[3];
+
+  grid.scalars = static_cast<const TScalar *>(image->GetScalarPointer());
+  for (int a = 0; a < 3; a++)
+  {
+    grid.origin[a] = image->GetOrigin()[a];
+    grid.inv_spacing[a] = 1.0 / image->GetSpacing()[a];
+    grid.offset[a] = extent[2 * a];
+    grid.max_index[a] = extent[2 * a + 1] - extent[2 * a];
+    dims[a] = grid.max_index[a] + 1;
+  }
+  grid.inc[0] = components;
+  grid.inc[1] = grid.inc[0] * dims[0];
+  grid.inc[2] = grid.inc[1] * dims[1];
+  for (int a = 0; a < 3; a++)
+  {
+    grid.step[a] = grid.max_index[a] > 0 ? grid.inc[a] : 0;
+  }
+
+  // sample the bricked copy of the scalars when the volume has one
+  vtkDataArray *bricks = image->GetFieldData()->GetArray("ImageFileBricks");
+  grid.bricked = bricks && bricks->GetDataType() == image->GetScalarType();
+  if (grid.bricked)
+  {
+    grid.scalars = static_cast<const TScalar *>(bricks->GetVoidPointer(0));
+    GetBrickAddresses(dims, grid.address);
+  }
+
+  return grid;
+}
+
+template <class TScalar>
+void BrickImageTyped(vtkImageData *image, TScalar *bricks, int n_threads)
+{
+  ImageGrid<TScalar> plain = GetImageGrid<TScalar>(image);
+  int dims[3] = {plain.max_index[0] + 1, plain.max_index[1] + 1, plain.max_index[2] + 1};
+  std::vector<vtkIdType> address[3];
+  GetBrickAddresses(dims, address);
+
+  ParallelFor(dims[2], n_threads, [&](int k) {
+    for (int j = 0; j < dims[1]; j++)
+    {
+      const TScalar *row = plain.scalars + j * plain.inc[1] + k * plain.inc[2];
+      TScalar *brick_row = bricks + address[1][j] + address[2][k];
+      for (int i = 0; i < dims[0]; i++)
+      {
+        brick_row[address[0][i]] = row[i];
+      }
+    }
+  });
+}
+
+// Copy the scalars in the bricked layout, kept along the image as the field array ImageFileBricks.
+// Curved surfaces cross the volume diagonally: neighbouring samples then share cache lines and pages more often.
+void BrickImage(vtkImageData *image, int n_threads)
+{
+  if (image->GetNumberOfScalarComponents() != 1)
+  {
+    CMPR_LOG(LOG_WARNING, "bricked layout needs single component scalars");
+    return;
+  }
+
+  int *extent = image->GetExtent();
+  vtkIdType n_bricks = 1;
+  for (int a = 0; a < 3; a++)
+  {
+    n_bricks *= (extent[2 * a + 1] - extent[2 * a] + BRICK_SIZE) / BRICK_SIZE;
+  }
+
+  vtkSmartPointer<vtkDataArray> bricks = vtkSmartPointer<vtkDataArray>::Take(vtkDataArray::CreateDataArray(image->GetScalarType()));
+  bricks->SetName("ImageFileBricks");
+  bricks->SetNumberOfTuples(n_bricks * BRICK_SIZE * BRICK_SIZE * BRICK_SIZE);
+
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(BrickImageTyped<VTK_TT>(image, static_cast<VTK_TT *>(bricks->GetVoidPointer(0)), n_threads));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << image->GetScalarType());
+    return;
+  }
+
+  image->GetFieldData()->AddArray(bricks);
+}
+
+// Memory offsets of the two corners of a cell along an axis
+template <class TScalar>
+inline void GetCellAddresses(const ImageGrid<TScalar> &grid, int a, int i, vtkIdType address[2])
+{
+  if (grid.bricked)
+  {
+    address[0] = grid.address[a][i];
+    address[1] = grid.address[a][i + 1];
+  }
+  else
+  {
+    address[0] = i * grid.inc[a];
+    address[1] = address[0] + grid.step[a];
+  }
+}
+
+// Integral scalars are rounded like vtkProbeFilter does when it interpolates into the source array type
+template <class TScalar>
+inline double CastSample(double value)
+{
+  if (std::numeric_limits<TScalar>::is_integer)
+  {
+    return double(TScalar(value >= 0.0 ? value + 0.5 : value - 0.5));
+  }
+  return value;
+}
+
+// Trilinear interpolation at a world position, 0 outside the volume (vtkProbeFilter null value)
+template <class TScalar>
+inline double SampleTrilinear(const ImageGrid<TScalar> &grid, double x, double y, double z)
+{
+  const double tolerance = 1e-6;
+  double p[3] = {x, y, z};
+  double f[3];
+  int index[3];
+
+  for (int a = 0; a < 3; a++)
+  {
+    double c = (p[a] - grid.origin[a]) * grid.inv_spacing[a] - grid.offset[a];
+    if (!(c >= -tolerance && c <= grid.max_index[a] + tolerance))
+    {
+      return 0.0;
+    }
+    c = std::min(std::max(c, 0.0), double(grid.max_index[a]));
+
+    int i = int(c);
+    if (i == grid.max_index[a] && i > 0)
+    {
+      i--;
+    }
+    f[a] = c - i;
+    index[a] = i;
+  }
+
+  const TScalar *s = grid.scalars;
+  vtkIdType ax[2], ay[2], az[2];
+  GetCellAddresses(grid, 0, index[0], ax);
+  GetCellAddresses(grid, 1, index[1], ay);
+  GetCellAddresses(grid, 2, index[2], az);
+  double v000 = s[ax[0] + ay[0] + az[0]];
+  double v100 = s[ax[1] + ay[0] + az[0]];
+  double v010 = s[ax[0] + ay[1] + az[0]];
+  double v110 = s[ax[1] + ay[1] + az[0]];
+  double v001 = s[ax[0] + ay[0] + az[1]];
+  double v101 = s[ax[1] + ay[0] + az[1]];
+  double v011 = s[ax[0] + ay[1] + az[1]];
+  double v111 = s[ax[1] + ay[1] + az[1]];
+
+  double v00 = v000 + f[0] * (v100 - v000);
+  double v10 = v010 + f[0] * (v110 - v010);
+  double v01 = v001 + f[0] * (v101 - v001);
+  double v11 = v011 + f[0] * (v111 - v011);
+  double v0 = v00 + f[1] * (v10 - v00);
+  double v1 = v01 + f[1] * (v11 - v01);
+
+  return CastSample<TScalar>(v0 + f[2] * (v1 - v0));
+}
+
+// Instruction sets of the batch kernels, the widest one supported is picked at runtime
+enum SimdLevel
+{
+  SIMD_SCALAR,
+  SIMD_SSE42,
+  SIMD_AVX2,
+  SIMD_AVX512
+};
+
+int DetectSimdLevel()
+{
+#if defined(CMPR_SIMD_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int n_ids = info[0];
+  __cpuid(info, 1);
+  bool sse42 = (info[2] >> 20) & 1;
+  bool avx = (info[2] >> 28) & 1;
+  bool osxsave = (info[2] >> 27) & 1;
+  bool avx2 = false;
+  bool avx512 = false;
+  if (n_ids >= 7)
+  {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] >> 5) & 1;
+    avx512 = (info[1] >> 16) & 1;
+  }
+
+  // the os must save the ymm / zmm registers too
+  unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+  if (avx512 && (xcr0 & 0xe6) == 0xe6)
+  {
+    return SIMD_AVX512;
+  }
+  if (avx && avx2 && (xcr0 & 0x6) == 0x6)
+  {
+    return SIMD_AVX2;
+  }
+  if (sse42)
+  {
+    return SIMD_SSE42;
+  }
+#elif defined(CMPR_SIMD_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+  {
+    return SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    return SIMD_SSE42;
+  }
+#endif
+  return SIMD_SCALAR;
+}
+
+// Detected once, the first time a volume is sampled
+int GetSimdLevel()
+{
+  static int level = DetectSimdLevel();
+  return level;
+}
+
+// Per-axis constants of a batch kernel, broadcast once per call
+struct KernelAxis
+{
+  double origin;
+  double inv_spacing;
+  double offset;
+  double low;       // -tolerance
+  double high;      // max_index + tolerance
+  double max_index;
+  double max_cell;  // first index of the last cell
+  double inc;
+};
+
+template <class TScalar>
+void GetKernelAxes(const ImageGrid<TScalar> &grid, KernelAxis axes[3])
+{
+  const double tolerance = 1e-6;
+  for (int a = 0; a < 3; a++)
+  {
+    axes[a].origin = grid.origin[a];
+    axes[a].inv_spacing = grid.inv_spacing[a];
+    axes[a].offset = grid.offset[a];
+    axes[a].low = -tolerance;
+    axes[a].high = grid.max_index[a] + tolerance;
+    axes[a].max_index = grid.max_index[a];
+    axes[a].max_cell = std::max(grid.max_index[a] - 1, 0);
+    axes[a].inc = double(grid.inc[a]);
+  }
+}
+
+// The 8 corners of the cells of a batch, from the offset of the first corner in the plain layout
+// or from the cell indices in the bricked one. Lanes outside the volume read the first cell (their value is masked).
+template <class TScalar, int W>
+inline void GetCorners(const ImageGrid<TScalar> &grid, const double *base, const double index[3][W], double corners[8][W])
+{
+  const TScalar *s = grid.scalars;
+  if (!grid.bricked)
+  {
+    const vtkIdType s0 = grid.step[0], s1 = grid.step[1], s2 = grid.step[2];
+    for (int l = 0; l < W; l++)
+    {
+      const TScalar *c = s + vtkIdType(base[l]);
+      corners[0][l] = c[0];
+      corners[1][l] = c[s0];
+      corners[2][l] = c[s1];
+      corners[3][l] = c[s0 + s1];
+      corners[4][l] = c[s2];
+      corners[5][l] = c[s0 + s2];
+      corners[6][l] = c[s1 + s2];
+      corners[7][l] = c[s0 + s1 + s2];
+    }
+    return;
+  }
+
+  for (int l = 0; l < W; l++)
+  {
+    vtkIdType ax[2], ay[2], az[2];
+    GetCellAddresses(grid, 0, int(index[0][l]), ax);
+    GetCellAddresses(grid, 1, int(index[1][l]), ay);
+    GetCellAddresses(grid, 2, int(index[2][l]), az);
+    corners[0][l] = s[ax[0] + ay[0] + az[0]];
+    corners[1][l] = s[ax[1] + ay[0] + az[0]];
+    corners[2][l] = s[ax[0] + ay[1] + az[0]];
+    corners[3][l] = s[ax[1] + ay[1] + az[0]];
+    corners[4][l] = s[ax[0] + ay[0] + az[1]];
+    corners[5][l] = s[ax[1] + ay[0] + az[1]];
+    corners[6][l] = s[ax[0] + ay[1] + az[1]];
+    corners[7][l] = s[ax[1] + ay[1] + az[1]];
+  }
+}
+
+#ifdef CMPR_SIMD_X86
+
+// Last points of the vector kernels, out of line and out of their target: compiled for the baseline instruction
+// set as the scalar level is, they round as SampleTrilinear does there (no fma)
+template <class TScalar>
+CMPR_NOINLINE void SampleTrilinearTail(const ImageGrid<TScalar> &grid, const double *x, const double *y, const double *z,
+                                       int begin, int n, double *out)
+{
+  for (int i = begin; i < n; i++)
+  {
+    out[i] = SampleTrilinear(grid, x[i], y[i], z[i]);
+  }
+}
+
+// SSE4.2: 2 points per vector
+template <class TScalar>
+CMPR_TARGET("sse4.2")
+void SampleTrilinearSSE42(const ImageGrid<TScalar> &grid, const double *x, const double *y, const double *z, int n, double *out)
+{
+  KernelAxis axes[3];
+  GetKernelAxes(grid, axes);
+  const double *p[3] = {x, y, z};
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d half = _mm_set1_pd(0.5);
+  const bool integral = std::numeric_limits<TScalar>::is_integer;
+
+  int i = 0;
+  for (; i + 2 <= n; i += 2)
+  {
+    __m128d inside = _mm_castsi128_pd(_mm_set1_epi32(-1));
+    __m128d base = zero;
+    __m128d f[3];
+    __m128d index[3];
+    for (int a = 0; a < 3; a++)
+    {
+      __m128d c = _mm_sub_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(p[a] + i), _mm_set1_pd(axes[a].origin)),
+                                        _mm_set1_pd(axes[a].inv_spacing)),
+                             _mm_set1_pd(axes[a].offset));
+      inside = _mm_and_pd(inside, _mm_and_pd(_mm_cmpge_pd(c, _mm_set1_pd(axes[a].low)),
+                                             _mm_cmple_pd(c, _mm_set1_pd(axes[a].high))));
+      c = _mm_min_pd(_mm_max_pd(c, zero), _mm_set1_pd(axes[a].max_index));
+      index[a] = _mm_min_pd(_mm_round_pd(c, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC), _mm_set1_pd(axes[a].max_cell));
+      f[a] = _mm_sub_pd(c, index[a]);
+      base = _mm_add_pd(base, _mm_mul_pd(index[a], _mm_set1_pd(axes[a].inc)));
+    }
+    alignas(16) double b[2];
+    alignas(16) double idx[3][2];
+    alignas(16) double v[8][2];
+    _mm_store_pd(b, _mm_and_pd(base, inside));
+    for (int a = 0; grid.bricked && a < 3; a++)
+    {
+      _mm_store_pd(idx[a], _mm_and_pd(index[a], inside));
+    }
+    GetCorners<TScalar, 2>(grid, b, idx, v);
+
+    __m128d v000 = _mm_load_pd(v[0]), v100 = _mm_load_pd(v[1]), v010 = _mm_load_pd(v[2]), v110 = _mm_load_pd(v[3]);
+    __m128d v001 = _mm_load_pd(v[4]), v101 = _mm_load_pd(v[5]), v011 = _mm_load_pd(v[6]), v111 = _mm_load_pd(v[7]);
+    __m128d v00 = _mm_add_pd(v000, _mm_mul_pd(f[0], _mm_sub_pd(v100, v000)));
+    __m128d v10 = _mm_add_pd(v010, _mm_mul_pd(f[0], _mm_sub_pd(v110, v010)));
+    __m128d v01 = _mm_add_pd(v001, _mm_mul_pd(f[0], _mm_sub_pd(v101, v001)));
+    __m128d v11 = _mm_add_pd(v011, _mm_mul_pd(f[0], _mm_sub_pd(v111, v011)));
+    __m128d v0 = _mm_add_pd(v00, _mm_mul_pd(f[1], _mm_sub_pd(v10, v00)));
+    __m128d v1 = _mm_add_pd(v01, _mm_mul_pd(f[1], _mm_sub_pd(v11, v01)));
+    __m128d value = _mm_add_pd(v0, _mm_mul_pd(f[2], _mm_sub_pd(v1, v0)));
+
+    if (integral)
+    {
+      // round half away from zero
+      __m128d sign = _mm_and_pd(value, _mm_set1_pd(-0.0));
+      value = _mm_round_pd(_mm_add_pd(value, _mm_or_pd(half, sign)), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    }
+    _mm_storeu_pd(out + i, _mm_and_pd(value, inside));
+  }
+
+  SampleTrilinearTail(grid, x, y, z, i, n, out);
+}
+
+// AVX2: 4 points per vector
+template <class TScalar>
+CMPR_TARGET("avx2")
+void SampleTrilinearAVX2(const ImageGrid<TScalar> &grid, const double *x, const double *y, const double *z, int n, double *out)
+{
+  KernelAxis axes[3];
+  GetKernelAxes(grid, axes);
+  const double *p[3] = {x, y, z};
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d half = _mm256_set1_pd(0.5);
+  const bool integral = std::numeric_limits<TScalar>::is_integer;
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256d inside = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+    __m256d base = zero;
+    __m256d f[3];
+    __m256d index[3];
+    for (int a = 0; a < 3; a++)
+    {
+      __m256d c = _mm256_sub_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(p[a] + i), _mm256_set1_pd(axes[a].origin)),
+                                              _mm256_set1_pd(axes[a].inv_spacing)),
+                                _mm256_set1_pd(axes[a].offset));
+      inside = _mm256_and_pd(inside, _mm256_and_pd(_mm256_cmp_pd(c, _mm256_set1_pd(axes[a].low), _CMP_GE_OQ),
+                                                   _mm256_cmp_pd(c, _mm256_set1_pd(axes[a].high), _CMP_LE_OQ)));
+      c = _mm256_min_pd(_mm256_max_pd(c, zero), _mm256_set1_pd(axes[a].max_index));
+      index[a] = _mm256_min_pd(_mm256_round_pd(c, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC), _mm256_set1_pd(axes[a].max_cell));
+      f[a] = _mm256_sub_pd(c, index[a]);
+      base = _mm256_add_pd(base, _mm256_mul_pd(index[a], _mm256_set1_pd(axes[a].inc)));
+    }
+    alignas(32) double b[4];
+    alignas(32) double idx[3][4];
+    alignas(32) double v[8][4];
+    _mm256_store_pd(b, _mm256_and_pd(base, inside));
+    for (int a = 0; grid.bricked && a < 3; a++)
+    {
+      _mm256_store_pd(idx[a], _mm256_and_pd(index[a], inside));
+    }
+    GetCorners<TScalar, 4>(grid, b, idx, v);
+
+    __m256d v000 = _mm256_load_pd(v[0]), v100 = _mm256_load_pd(v[1]), v010 = _mm256_load_pd(v[2]), v110 = _mm256_load_pd(v[3]);
+    __m256d v001 = _mm256_load_pd(v[4]), v101 = _mm256_load_pd(v[5]), v011 = _mm256_load_pd(v[6]), v111 = _mm256_load_pd(v[7]);
+    __m256d v00 = _mm256_add_pd(v000, _mm256_mul_pd(f[0], _mm256_sub_pd(v100, v000)));
+    __m256d v10 = _mm256_add_pd(v010, _mm256_mul_pd(f[0], _mm256_sub_pd(v110, v010)));
+    __m256d v01 = _mm256_add_pd(v001, _mm256_mul_pd(f[0], _mm256_sub_pd(v101, v001)));
+    __m256d v11 = _mm256_add_pd(v011, _mm256_mul_pd(f[0], _mm256_sub_pd(v111, v011)));
+    __m256d v0 = _mm256_add_pd(v00, _mm256_mul_pd(f[1], _mm256_sub_pd(v10, v00)));
+    __m256d v1 = _mm256_add_pd(v01, _mm256_mul_pd(f[1], _mm256_sub_pd(v11, v01)));
+    __m256d value = _mm256_add_pd(v0, _mm256_mul_pd(f[2], _mm256_sub_pd(v1, v0)));
+
+    if (integral)
+    {
+      // round half away from zero
+      __m256d sign = _mm256_and_pd(value, _mm256_set1_pd(-0.0));
+      value = _mm256_round_pd(_mm256_add_pd(value, _mm256_or_pd(half, sign)), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    }
+    _mm256_storeu_pd(out + i, _mm256_and_pd(value, inside));
+  }
+
+  SampleTrilinearTail(grid, x, y, z, i, n, out);
+}
+
+// Products kept apart from the following add, as in the scalar kernel: the compiler may not fuse them into an fma
+CMPR_TARGET("avx512f")
+inline __m512d MulNoContract512(__m512d a, __m512d b)
+{
+  return _mm512_mul_round_pd(a, b, _MM_FROUND_CUR_DIRECTION);
+}
+
+// AVX-512: 8 points per vector
+template <class TScalar>
+CMPR_TARGET("avx512f")
+void SampleTrilinearAVX512(const ImageGrid<TScalar> &grid, const double *x, const double *y, const double *z, int n, double *out)
+{
+  KernelAxis axes[3];
+  GetKernelAxes(grid, axes);
+  const double *p[3] = {x, y, z};
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d half = _mm512_set1_pd(0.5);
+  const bool integral = std::numeric_limits<TScalar>::is_integer;
+
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __mmask8 inside = 0xff;
+    __m512d base = zero;
+    __m512d f[3];
+    __m512d index[3];
+    for (int a = 0; a < 3; a++)
+    {
+      __m512d c = _mm512_sub_pd(MulNoContract512(_mm512_sub_pd(_mm512_loadu_pd(p[a] + i), _mm512_set1_pd(axes[a].origin)),
+                                              _mm512_set1_pd(axes[a].inv_spacing)),
+                                _mm512_set1_pd(axes[a].offset));
+      inside &= _mm512_cmp_pd_mask(c, _mm512_set1_pd(axes[a].low), _CMP_GE_OQ) &
+                _mm512_cmp_pd_mask(c, _mm512_set1_pd(axes[a].high), _CMP_LE_OQ);
+      c = _mm512_min_pd(_mm512_max_pd(c, zero), _mm512_set1_pd(axes[a].max_index));
+      index[a] = _mm512_min_pd(_mm512_roundscale_pd(c, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC), _mm512_set1_pd(axes[a].max_cell));
+      f[a] = _mm512_sub_pd(c, index[a]);
+      base = _mm512_add_pd(base, MulNoContract512(index[a], _mm512_set1_pd(axes[a].inc)));
+    }
+    alignas(64) double b[8];
+    alignas(64) double idx[3][8];
+    alignas(64) double v[8][8];
+    _mm512_store_pd(b, _mm512_maskz_mov_pd(inside, base));
+    for (int a = 0; grid.bricked && a < 3; a++)
+    {
+      _mm512_store_pd(idx[a], _mm512_maskz_mov_pd(inside, index[a]));
+    }
+    GetCorners<TScalar, 8>(grid, b, idx, v);
+
+    __m512d v000 = _mm512_load_pd(v[0]), v100 = _mm512_load_pd(v[1]), v010 = _mm512_load_pd(v[2]), v110 = _mm512_load_pd(v[3]);
+    __m512d v001 = _mm512_load_pd(v[4]), v101 = _mm512_load_pd(v[5]), v011 = _mm512_load_pd(v[6]), v111 = _mm512_load_pd(v[7]);
+    __m512d v00 = _mm512_add_pd(v000, MulNoContract512(f[0], _mm512_sub_pd(v100, v000)));
+    __m512d v10 = _mm512_add_pd(v010, MulNoContract512(f[0], _mm512_sub_pd(v110, v010)));
+    __m512d v01 = _mm512_add_pd(v001, MulNoContract512(f[0], _mm512_sub_pd(v101, v001)));
+    __m512d v11 = _mm512_add_pd(v011, MulNoContract512(f[0], _mm512_sub_pd(v111, v011)));
+    __m512d v0 = _mm512_add_pd(v00, MulNoContract512(f[1], _mm512_sub_pd(v10, v00)));
+    __m512d v1 = _mm512_add_pd(v01, MulNoContract512(f[1], _mm512_sub_pd(v11, v01)));
+    __m512d value = _mm512_add_pd(v0, MulNoContract512(f[2], _mm512_sub_pd(v1, v0)));
+
+    if (integral)
+    {
+      // round half away from zero
+      __mmask8 negative = _mm512_cmp_pd_mask(value, zero, _CMP_LT_OQ);
+      value = _mm512_mask_sub_pd(_mm512_add_pd(value, half), negative, value, half);
+      value = _mm512_roundscale_pd(value, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    }
+    _mm512_storeu_pd(out + i, _mm512_maskz_mov_pd(inside, value));
+  }
+
+  SampleTrilinearTail(grid, x, y, z, i, n, out);
+}
+
+#endif
+
+// Trilinear samples of n world positions given as separate x, y, z arrays, same values as SampleTrilinear
+template <class TScalar>
+void SampleTrilinearBatch(const ImageGrid<TScalar> &grid, const double *x, const double *y, const double *z, int n, double *out, int level)
+{
+  switch (level)
+  {
+#ifdef CMPR_SIMD_X86
+  case SIMD_AVX512:
+    SampleTrilinearAVX512(grid, x, y, z, n, out);
+    return;
+  case SIMD_AVX2:
+    SampleTrilinearAVX2(grid, x, y, z, n, out);
+    return;
+  case SIMD_SSE42:
+    SampleTrilinearSSE42(grid, x, y, z, n, out);
+    return;
+#endif
+  default:
+    for (int i = 0; i < n; i++)
+    {
+      out[i] = SampleTrilinear(grid, x[i], y[i], z[i]);
+    }
+  }
+}
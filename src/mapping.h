@@ -0,0 +1,531 @@
+// Static 3d tree over a point set for nearest point queries, read only once built (safe from several threads)
+class KdTree
+{
+public:
+  // stride: only every stride-th point (and the last one) is a candidate
+  void Build(const std::vector<double> &xyz, int stride = 1)
+  {
+    points = xyz;
+    int n = int(points.size() / 3);
+    index.clear();
+    for (int i = 0; i < n; i += stride)
+    {
+      index.push_back(i);
+    }
+    if (n > 0 && index.back() != n - 1)
+    {
+      index.push_back(n - 1);
+    }
+    Build(0, int(index.size()), 0);
+  }
+
+  // Index of the closest candidate point, -1 on an empty tree
+  int FindClosest(const double x[3]) const
+  {
+    int best = -1;
+    double best_d2 = std::numeric_limits<double>::max();
+    Search(0, int(index.size()), 0, x, best, best_d2);
+    return best;
+  }
+
+private:
+  // the median of [begin, end) along the axis of the depth is the node, smaller coordinates before it
+  void Build(int begin, int end, int depth)
+  {
+    if (end - begin < 2)
+    {
+      return;
+    }
+    int axis = depth % 3;
+    int mid = (begin + end) / 2;
+    std::nth_element(index.begin() + begin, index.begin() + mid, index.begin() + end,
+                     [this, axis](int a, int b) { return points[3 * a + axis] < points[3 * b + axis]; });
+    Build(begin, mid, depth + 1);
+    Build(mid + 1, end, depth + 1);
+  }
+
+  void Search(int begin, int end, int depth, const double x[3], int &best, double &best_d2) const
+  {
+    if (begin >= end)
+    {
+      return;
+    }
+    int mid = (begin + end) / 2;
+    const double *p = &points[3 * index[mid]];
+    double d2 = vtkMath::Distance2BetweenPoints(x, p);
+    if (d2 < best_d2)
+    {
+      best_d2 = d2;
+      best = index[mid];
+    }
+
+    // near side first, the far side only if the splitting plane is closer than the best point
+    double diff = x[depth % 3] - p[depth % 3];
+    if (diff < 0)
+    {
+      Search(begin, mid, depth + 1, x, best, best_d2);
+      if (diff * diff < best_d2)
+      {
+        Search(mid + 1, end, depth + 1, x, best, best_d2);
+      }
+    }
+    else
+    {
+      Search(mid + 1, end, depth + 1, x, best, best_d2);
+      if (diff * diff < best_d2)
+      {
+        Search(begin, mid, depth + 1, x, best, best_d2);
+      }
+    }
+  }
+
+  std::vector<double> points;
+  std::vector<int> index;
+};
+
+// Point mapping between the pixels of a cmpr response and patient (world) space, both ways.
+// Pixel coordinates are [image, row, col] of pixels_cmpr (image: stack slice or rotation angle) and
+// [frame, row, col] of pixels_axial, as indexed in the returned arrays; they may be fractional.
+// Cmpr pixel (image, row, col) lies at line[row] + direction(image, row) * (col + first_col) * spacing + offset(image),
+// the reverse mapping finds the row through a k-d tree over the rows, then solves the rest in that row
+// (all the rows are scanned when that row does not reach the point, where the sheets of far rows cross).
+class CmprMapping
+{
+public:
+  // directions: sweep directions of the rows, one set per rotation angle for a rotational cmpr (angles over
+  // [0, 180) degrees, offsets unused), a single set for a stack of images shifted by offsets
+  CmprMapping(vtkPolyData *line, int rows, const std::vector<double> &directions, const std::vector<double> &offsets,
+              double spacing, int first_col, const AxialFrames &frames)
+      : rows(std::max(rows, 0)), directions(directions), offsets(offsets), spacing(spacing), first_col(first_col), frames(frames)
+  {
+    this->line.resize(3 * this->rows);
+    tangents.resize(3 * this->rows);
+    for (int row = 0; row < this->rows; row++)
+    {
+      line->GetPoint(row, &this->line[3 * row]);
+      GetLineTangent(line, row, &tangents[3 * row]);
+    }
+    n_angles = this->rows > 0 ? int(directions.size() / (3 * this->rows)) : 0;
+    rotational = n_angles > 1;
+    if (this->offsets.size() < 3)
+    {
+      this->offsets.assign(3, 0.0);
+    }
+    row_tree.Build(this->line, tree_stride);
+
+    // axial frames: centers of the planes
+    side = frames.resolution + 1;
+    n_frames = int(frames.basis.size() / 9);
+    std::vector<double> centers(3 * n_frames);
+    for (int f = 0; f < n_frames; f++)
+    {
+      const double *basis = &frames.basis[9 * f];
+      GetAxialPoint(basis, frames.spacing, 0, 0, &centers[3 * f]);
+      for (int a = 0; a < 3; a++)
+      {
+        centers[3 * f + a] += (basis[3 + a] + basis[6 + a]) * frames.spacing * frames.resolution / 2;
+      }
+    }
+    frame_tree.Build(centers, tree_stride);
+  }
+
+  // Pixels of a cmpr sampled on a viewport: returned pixel (row, col) is (row_origin + row * row_step,
+  // col_origin + col * col_step) of the whole cmpr
+  void SetViewport(double row_origin, double row_step, double col_origin, double col_step)
+  {
+    this->row_origin = row_origin;
+    this->row_step = row_step;
+    this->col_origin = col_origin;
+    this->col_step = col_step;
+  }
+
+  // n points [image, row, col] -> n points [x, y, z]
+  std::vector<double> CmprToWorld(const double *pixels, size_t n) const
+  {
+    std::vector<double> world(3 * n);
+    for (size_t p = 0; p < n && rows > 0; p++)
+    {
+      const double *pixel = pixels + 3 * p;
+      double row = std::min(std::max(row_origin + pixel[1] * row_step, 0.0), double(rows - 1));
+      int r0 = int(row);
+      int r1 = std::min(r0 + 1, rows - 1);
+      double u = (col_origin + pixel[2] * col_step + first_col) * spacing;
+      double x0[3], x1[3];
+      GetCmprPoint(r0, pixel[0], u, x0);
+      GetCmprPoint(r1, pixel[0], u, x1);
+      for (int a = 0; a < 3; a++)
+      {
+        world[3 * p + a] = x0[a] + (row - r0) * (x1[a] - x0[a]);
+      }
+    }
+    return world;
+  }
+
+  // n points [x, y, z] -> n points [image, row, col] of the closest cmpr row, in blocks on every core
+  std::vector<double> WorldToCmpr(const double *world, size_t n) const
+  {
+    std::vector<double> pixels(3 * n);
+    if (rows > 0)
+    {
+      MapBlocks(n, [&](size_t p) { WorldToCmprPoint(world + 3 * p, &pixels[3 * p]); });
+    }
+    return pixels;
+  }
+
+  // n points [frame, row, col] of pixels_axial -> n points [x, y, z]
+  std::vector<double> AxialToWorld(const double *pixels, size_t n) const
+  {
+    std::vector<double> world(3 * n);
+    for (size_t p = 0; p < n && n_frames > 0; p++)
+    {
+      const double *pixel = pixels + 3 * p;
+      // pixels_axial is stored reversed: last frame first, each plane turned by 180 degrees
+      double frame = std::min(std::max(n_frames - 1 - pixel[0], 0.0), double(n_frames - 1));
+      double j = side - 1 - pixel[1];
+      double i = side - 1 - pixel[2];
+      int f0 = int(frame);
+      int f1 = std::min(f0 + 1, n_frames - 1);
+      double x0[3], x1[3];
+      GetPlanePoint(f0, i, j, x0);
+      GetPlanePoint(f1, i, j, x1);
+      for (int a = 0; a < 3; a++)
+      {
+        world[3 * p + a] = x0[a] + (frame - f0) * (x1[a] - x0[a]);
+      }
+    }
+    return world;
+  }
+
+  // n points [x, y, z] -> n points [frame, row, col] of pixels_axial, projected on the closest plane
+  std::vector<double> WorldToAxial(const double *world, size_t n) const
+  {
+    std::vector<double> pixels(3 * n);
+    if (n_frames > 0)
+    {
+      MapBlocks(n, [&](size_t p) { WorldToAxialPoint(world + 3 * p, &pixels[3 * p]); });
+    }
+    return pixels;
+  }
+
+private:
+  // Run map(p) for the n points, by blocks of points spread over the cores
+  void MapBlocks(size_t n, const std::function<void(size_t)> &map) const
+  {
+    const size_t block = 256;
+    ParallelFor(int((n + block - 1) / block), 0, [&](int b) {
+      for (size_t p = b * block; p < std::min((b + 1) * block, n); p++)
+      {
+        map(p);
+      }
+    });
+  }
+
+  // One point of WorldToCmpr, c = (u, image)
+  void WorldToCmprPoint(const double x[3], double pixel[3]) const
+  {
+    auto solve = [this](double position, const double *at, double *c) { return SolveRow(position, at, c[0], c[1]); };
+    auto point = [this](int row, const double *c, double *p) { GetCmprPoint(row, c[1], c[0], p); };
+    double position, c[2];
+    Locate(rows, row_tree.FindClosest(x), x, 1e-3 * spacing, solve, point, position, c);
+
+    pixel[0] = c[1];
+    pixel[1] = (position - row_origin) / row_step;
+    pixel[2] = (c[0] / spacing - first_col - col_origin) / col_step;
+  }
+
+  // One point of WorldToAxial, c = (i, j)
+  void WorldToAxialPoint(const double x[3], double pixel[3]) const
+  {
+    auto solve = [this](double position, const double *at, double *c) { return SolveFrame(position, at, c[0], c[1]); };
+    auto point = [this](int frame, const double *c, double *p) { GetPlanePoint(frame, c[0], c[1], p); };
+    double position, c[2];
+    Locate(n_frames, frame_tree.FindClosest(x), x, 1e-3 * frames.spacing, solve, point, position, c);
+
+    pixel[0] = n_frames - 1 - position;
+    pixel[1] = side - 1 - c[1];
+    pixel[2] = side - 1 - c[0];
+  }
+
+  // Fractional row (or frame) whose solved point is closest to x, and the coordinates c of that point in it.
+  // solve(position, x, c) returns the distance of x to the interpolated row, point(row, c, p) the point of a row.
+  // A walk from the start row first; where rows far apart cross (the centerline bends more than the sweep is wide)
+  // it may end away from x, then the lowest local minimums over all rows are tried.
+  template <typename Solve, typename Point>
+  void Locate(int count, int start, const double x[3], double tolerance, const Solve &solve, const Point &point,
+              double &position, double c[2]) const
+  {
+    double best = Refine(count, Walk(count, start, x, solve), x, solve, point, position, c);
+    if (best <= tolerance)
+    {
+      return;
+    }
+
+    std::vector<double> distances(count);
+    for (int row = 0; row < count; row++)
+    {
+      double c_row[2];
+      distances[row] = solve(row, x, c_row);
+    }
+    std::vector<std::pair<double, int>> minimums;
+    for (int row = 0; row < count; row++)
+    {
+      if ((row == 0 || distances[row] <= distances[row - 1]) && (row == count - 1 || distances[row] <= distances[row + 1]))
+      {
+        minimums.push_back(std::make_pair(distances[row], row));
+      }
+    }
+    std::sort(minimums.begin(), minimums.end());
+    for (size_t m = 0; m < std::min(minimums.size(), size_t(4)) && best > tolerance; m++)
+    {
+      double position_m, c_m[2];
+      double distance = Refine(count, minimums[m].second, x, solve, point, position_m, c_m);
+      if (distance < best)
+      {
+        best = distance;
+        position = position_m;
+        c[0] = c_m[0];
+        c[1] = c_m[1];
+      }
+    }
+  }
+
+  // Walk from a row to the neighbour rows while they get closer to x
+  template <typename Solve>
+  int Walk(int count, int row, const double x[3], const Solve &solve) const
+  {
+    double c[2];
+    double best = solve(row, x, c);
+    for (int step = -1; step <= 1; step += 2)
+    {
+      for (int next = row + step; next >= 0 && next < count; next += step)
+      {
+        double distance = solve(next, x, c);
+        if (distance >= best)
+        {
+          break;
+        }
+        best = distance;
+        row = next;
+      }
+    }
+    return row;
+  }
+
+  // Fraction of the way to a neighbour row, from the points of the same coordinates on both rows around it,
+  // solved again at each step since the rows differ; returns the distance left
+  template <typename Solve, typename Point>
+  double Refine(int count, int row, const double x[3], const Solve &solve, const Point &point, double &position,
+                double c[2]) const
+  {
+    position = row;
+    double distance = solve(position, x, c);
+    for (int iteration = 0; iteration < 16 && count > 1; iteration++)
+    {
+      int r0 = std::min(int(position), count - 2);
+      double x0[3], x1[3], e[3], d[3];
+      point(r0, c, x0);
+      point(r0 + 1, c, x1);
+      vtkMath::Subtract(x1, x0, e);
+      for (int a = 0; a < 3; a++)
+      {
+        d[a] = x[a] - x0[a] - (position - r0) * e[a];
+      }
+      double e2 = vtkMath::Dot(e, e);
+      double shift = e2 > 0.0 ? vtkMath::Dot(d, e) / e2 : 0.0;
+      double next = std::min(std::max(position + shift, std::max(row - 1.0, 0.0)), std::min(row + 1.0, double(count - 1)));
+      if (std::abs(next - position) < 1e-9)
+      {
+        break;
+      }
+      double c_next[2];
+      double next_distance = solve(next, x, c_next);
+      if (next_distance >= distance)
+      {
+        break;
+      }
+      position = next;
+      distance = next_distance;
+      c[0] = c_next[0];
+      c[1] = c_next[1];
+    }
+    return distance;
+  }
+
+  // Plane coordinates i, j of the point of the (fractional) frame closest to x, returns their distance.
+  // Between two frames the plane origin and axes are interpolated as AxialToWorld does.
+  double SolveFrame(double frame, const double x[3], double &i, double &j) const
+  {
+    int f0 = std::min(int(frame), n_frames - 1);
+    int f1 = std::min(f0 + 1, n_frames - 1);
+    double f = frame - f0;
+    const double *b0 = &frames.basis[9 * f0];
+    const double *b1 = &frames.basis[9 * f1];
+    double q[3], u[3], v[3];
+    for (int a = 0; a < 3; a++)
+    {
+      q[a] = x[a] - (b0[a] + f * (b1[a] - b0[a]));
+      u[a] = (b0[3 + a] + f * (b1[3 + a] - b0[3 + a])) * frames.spacing;
+      v[a] = (b0[6 + a] + f * (b1[6 + a] - b0[6 + a])) * frames.spacing;
+    }
+
+    // least squares on both axes
+    double uu = vtkMath::Dot(u, u);
+    double uv = vtkMath::Dot(u, v);
+    double vv = vtkMath::Dot(v, v);
+    double uq = vtkMath::Dot(u, q);
+    double vq = vtkMath::Dot(v, q);
+    double det = uu * vv - uv * uv;
+    i = det > 0.0 ? (vv * uq - uv * vq) / det : 0.0;
+    j = det > 0.0 ? (uu * vq - uv * uq) / det : 0.0;
+
+    double r[3];
+    for (int a = 0; a < 3; a++)
+    {
+      r[a] = q[a] - u[a] * i - v[a] * j;
+    }
+    return vtkMath::Norm(r);
+  }
+
+  // Point of a row at distance u along its sweep direction, for a (fractional) image
+  void GetCmprPoint(int row, double image, double u, double x[3]) const
+  {
+    const double *p = &line[3 * row];
+    const double *d = &directions[3 * row];
+    if (rotational)
+    {
+      // turn the direction of angle 0 as RotateVector does, it is orthogonal to the tangent
+      double phi = vtkMath::Pi() * image / n_angles;
+      double b[3];
+      vtkMath::Cross(&tangents[3 * row], d, b);
+      for (int a = 0; a < 3; a++)
+      {
+        x[a] = p[a] + (d[a] * std::cos(phi) + b[a] * std::sin(phi)) * u;
+      }
+      return;
+    }
+
+    // offsets of a stack are evenly spaced
+    int n_images = int(offsets.size() / 3);
+    for (int a = 0; a < 3; a++)
+    {
+      double step = n_images > 1 ? offsets[3 + a] - offsets[a] : 0.0;
+      x[a] = p[a] + d[a] * u + offsets[a] + step * image;
+    }
+  }
+
+  // Sweep distance u and image of the point of the (fractional) row closest to x, returns their distance.
+  // Between two rows the point, the sweep direction and its normal are interpolated as CmprToWorld does.
+  double SolveRow(double row, const double x[3], double &u, double &image) const
+  {
+    int r0 = std::min(int(row), rows - 1);
+    int r1 = std::min(r0 + 1, rows - 1);
+    double f = row - r0;
+    double q[3], d[3], b[3], b0[3], b1[3];
+    vtkMath::Cross(&tangents[3 * r0], &directions[3 * r0], b0);
+    vtkMath::Cross(&tangents[3 * r1], &directions[3 * r1], b1);
+    for (int a = 0; a < 3; a++)
+    {
+      q[a] = x[a] - (line[3 * r0 + a] + f * (line[3 * r1 + a] - line[3 * r0 + a]));
+      d[a] = directions[3 * r0 + a] + f * (directions[3 * r1 + a] - directions[3 * r0 + a]);
+      b[a] = b0[a] + f * (b1[a] - b0[a]);
+    }
+
+    if (rotational)
+    {
+      // angle of x around the tangent from the direction of angle 0, in [-0.5, n_angles - 0.5) images with a signed u:
+      // q projected on the plane of d and b (no longer orthonormal between rows) is u (d cos(phi) + b sin(phi))
+      double dd = vtkMath::Dot(d, d);
+      double db = vtkMath::Dot(d, b);
+      double bb = vtkMath::Dot(b, b);
+      double dq = vtkMath::Dot(d, q);
+      double bq = vtkMath::Dot(b, q);
+      double det = dd * bb - db * db;
+      double alpha = det > 0.0 ? (bb * dq - db * bq) / det : 0.0;
+      double beta = det > 0.0 ? (dd * bq - db * dq) / det : 0.0;
+      double r[3];
+      for (int a = 0; a < 3; a++)
+      {
+        r[a] = q[a] - alpha * d[a] - beta * b[a];
+      }
+      double phi = std::atan2(beta, alpha);
+      u = std::sqrt(alpha * alpha + beta * beta);
+      if (phi < 0)
+      {
+        phi += vtkMath::Pi();
+        u = -u;
+      }
+      image = phi / vtkMath::Pi() * n_angles;
+      if (image >= n_angles - 0.5)
+      {
+        image -= n_angles;
+        u = -u;
+      }
+      return vtkMath::Norm(r);
+    }
+
+    // least squares on the sweep direction and the stack step
+    int n_images = int(offsets.size() / 3);
+    double w[3] = {0.0, 0.0, 0.0};
+    for (int a = 0; a < 3; a++)
+    {
+      q[a] -= offsets[a];
+      w[a] = n_images > 1 ? offsets[3 + a] - offsets[a] : 0.0;
+    }
+    double dd = vtkMath::Dot(d, d);
+    double dw = vtkMath::Dot(d, w);
+    double ww = vtkMath::Dot(w, w);
+    double dq = vtkMath::Dot(d, q);
+    double wq = vtkMath::Dot(w, q);
+    double det = dd * ww - dw * dw;
+    if (ww > 0.0 && det > 1e-12 * dd * ww)
+    {
+      u = (ww * dq - dw * wq) / det;
+      image = (dd * wq - dw * dq) / det;
+    }
+    else
+    {
+      u = dd > 0.0 ? dq / dd : 0.0;
+      image = 0.0;
+    }
+
+    double r[3];
+    for (int a = 0; a < 3; a++)
+    {
+      r[a] = q[a] - d[a] * u - w[a] * image;
+    }
+    return vtkMath::Norm(r);
+  }
+
+  void GetPlanePoint(int frame, double i, double j, double x[3]) const
+  {
+    const double *basis = &frames.basis[9 * frame];
+    for (int a = 0; a < 3; a++)
+    {
+      x[a] = basis[a] + i * frames.spacing * basis[3 + a] + j * frames.spacing * basis[6 + a];
+    }
+  }
+
+  // the trees hold every tree_stride-th row/frame, the walks finish from there:
+  // a point far from a dense centerline would visit most of a full tree
+  static const int tree_stride = 8;
+
+  int rows;
+  std::vector<double> line;     // rows x xyz
+  std::vector<double> tangents; // rows x xyz
+  std::vector<double> directions;
+  std::vector<double> offsets;
+  double spacing;
+  int first_col;
+  bool rotational;
+  int n_angles;
+  KdTree row_tree;
+  double row_origin = 0.0;
+  double row_step = 1.0;
+  double col_origin = 0.0;
+  double col_step = 1.0;
+
+  AxialFrames frames;
+  int side;
+  int n_frames;
+  KdTree frame_tree;
+};
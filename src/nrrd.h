@@ -0,0 +1,536 @@
+// Fields of a nrrd header needed to map or inflate its data section
+struct NrrdHeader
+{
+  int scalar_type = 0; // VTK scalar type, 0 if not supported
+  int dimension = 0;
+  int sizes[3] = {0, 0, 0};
+  double spacing[3] = {1.0, 1.0, 1.0};
+  double origin[3] = {0.0, 0.0, 0.0};
+  std::string encoding = "raw";
+  std::string endian = "little";
+  std::string data_file; // detached data, empty when attached to the header
+  long long byte_skip = 0;
+  long long line_skip = 0;
+  long long header_size = 0; // bytes before the attached data
+  std::vector<std::string> lines; // header lines after the magic, comments included
+};
+
+int GetNrrdScalarType(std::string type)
+{
+  static const std::map<std::string, int> types = {
+      {"signed char", VTK_SIGNED_CHAR}, {"int8", VTK_SIGNED_CHAR}, {"int8_t", VTK_SIGNED_CHAR},
+      {"uchar", VTK_UNSIGNED_CHAR}, {"unsigned char", VTK_UNSIGNED_CHAR}, {"uint8", VTK_UNSIGNED_CHAR}, {"uint8_t", VTK_UNSIGNED_CHAR},
+      {"short", VTK_SHORT}, {"short int", VTK_SHORT}, {"signed short", VTK_SHORT}, {"signed short int", VTK_SHORT},
+      {"int16", VTK_SHORT}, {"int16_t", VTK_SHORT},
+      {"ushort", VTK_UNSIGNED_SHORT}, {"unsigned short", VTK_UNSIGNED_SHORT}, {"unsigned short int", VTK_UNSIGNED_SHORT},
+      {"uint16", VTK_UNSIGNED_SHORT}, {"uint16_t", VTK_UNSIGNED_SHORT},
+      {"int", VTK_INT}, {"signed int", VTK_INT}, {"int32", VTK_INT}, {"int32_t", VTK_INT},
+      {"uint", VTK_UNSIGNED_INT}, {"unsigned int", VTK_UNSIGNED_INT}, {"uint32", VTK_UNSIGNED_INT}, {"uint32_t", VTK_UNSIGNED_INT},
+      {"longlong", VTK_LONG_LONG}, {"long long", VTK_LONG_LONG}, {"long long int", VTK_LONG_LONG},
+      {"signed long long", VTK_LONG_LONG}, {"signed long long int", VTK_LONG_LONG}, {"int64", VTK_LONG_LONG}, {"int64_t", VTK_LONG_LONG},
+      {"ulonglong", VTK_UNSIGNED_LONG_LONG}, {"unsigned long long", VTK_UNSIGNED_LONG_LONG},
+      {"unsigned long long int", VTK_UNSIGNED_LONG_LONG}, {"uint64", VTK_UNSIGNED_LONG_LONG}, {"uint64_t", VTK_UNSIGNED_LONG_LONG},
+      {"float", VTK_FLOAT},
+      {"double", VTK_DOUBLE}};
+
+  std::map<std::string, int>::const_iterator found = types.find(type);
+  return found == types.end() ? 0 : found->second;
+}
+
+// Numbers of a field value, "(1,0,0) (0,1,0)" or "1 2 3"
+std::vector<double> GetNrrdNumbers(const std::string &value)
+{
+  std::string text = value;
+  std::replace_if(text.begin(), text.end(), [](char c) { return c == '(' || c == ')' || c == ','; }, ' ');
+
+  std::vector<double> numbers;
+  std::istringstream stream(text);
+  double number;
+  while (stream >> number)
+  {
+    numbers.push_back(number);
+  }
+  return numbers;
+}
+
+// Parse the header of a nrrd (.nrrd or detached .nhdr) file, throws if the file is not a nrrd
+NrrdHeader ReadNrrdHeader(const std::string &path)
+{
+  std::ifstream file(path.c_str(), std::ios::binary);
+  std::string line;
+  if (!file || !std::getline(file, line) || line.compare(0, 4, "NRRD") != 0)
+  {
+    throw std::runtime_error("not a nrrd file: " + path);
+  }
+
+  NrrdHeader header;
+  while (std::getline(file, line))
+  {
+    if (!line.empty() && line[line.size() - 1] == '\r')
+    {
+      line.erase(line.size() - 1);
+    }
+    // a blank line ends the header
+    if (line.empty())
+    {
+      break;
+    }
+    header.lines.push_back(line);
+    if (line[0] == '#')
+    {
+      continue;
+    }
+
+    // "field: value", key/value pairs ("key:=value") are skipped
+    size_t colon = line.find(": ");
+    if (colon == std::string::npos)
+    {
+      continue;
+    }
+    std::string field = line.substr(0, colon);
+    std::string value = line.substr(colon + 2);
+    std::transform(field.begin(), field.end(), field.begin(), ::tolower);
+
+    if (field == "type")
+    {
+      header.scalar_type = GetNrrdScalarType(value);
+    }
+    else if (field == "dimension")
+    {
+      header.dimension = std::atoi(value.c_str());
+    }
+    else if (field == "sizes")
+    {
+      std::vector<double> sizes = GetNrrdNumbers(value);
+      for (size_t a = 0; a < 3 && a < sizes.size(); a++)
+      {
+        header.sizes[a] = int(sizes[a]);
+      }
+    }
+    else if (field == "spacings")
+    {
+      std::vector<double> spacings = GetNrrdNumbers(value);
+      for (size_t a = 0; a < 3 && a < spacings.size(); a++)
+      {
+        header.spacing[a] = spacings[a];
+      }
+    }
+    else if (field == "space directions")
+    {
+      // like vtkNrrdReader: the spacing is the length of each direction
+      std::vector<double> directions = GetNrrdNumbers(value);
+      for (size_t a = 0; a < 3 && 3 * a + 2 < directions.size(); a++)
+      {
+        const double *d = &directions[3 * a];
+        header.spacing[a] = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+      }
+    }
+    else if (field == "space origin")
+    {
+      std::vector<double> origin = GetNrrdNumbers(value);
+      for (size_t a = 0; a < 3 && a < origin.size(); a++)
+      {
+        header.origin[a] = origin[a];
+      }
+    }
+    else if (field == "encoding")
+    {
+      header.encoding = value;
+    }
+    else if (field == "endian")
+    {
+      header.endian = value;
+    }
+    else if (field == "data file" || field == "datafile")
+    {
+      header.data_file = value;
+    }
+    else if (field == "byte skip" || field == "byteskip")
+    {
+      header.byte_skip = std::atoll(value.c_str());
+    }
+    else if (field == "line skip" || field == "lineskip")
+    {
+      header.line_skip = std::atoll(value.c_str());
+    }
+  }
+
+  header.header_size = file ? (long long)file.tellg() : 0;
+
+  return header;
+}
+
+// Path of the detached data file, relative paths start from the header directory
+std::string GetNrrdDataPath(const std::string &path, const std::string &data_file)
+{
+  if (data_file[0] == '/' || data_file.find(':') != std::string::npos)
+  {
+    return data_file;
+  }
+
+  size_t slash = path.find_last_of("/\\");
+  return slash == std::string::npos ? data_file : path.substr(0, slash + 1) + data_file;
+}
+
+// Read-only mapping of a whole file, the pages are shared with every process mapping the same file
+class MappedFile
+{
+public:
+  MappedFile(const std::string &path) : data(nullptr), size(0)
+  {
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+      throw std::runtime_error("cannot open " + path);
+    }
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    size = size_t(file_size.QuadPart);
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL)
+    {
+      data = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+#else
+    file = open(path.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+      throw std::runtime_error("cannot open " + path);
+    }
+    struct stat info;
+    fstat(file, &info);
+    size = size_t(info.st_size);
+    void *view = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+    data = view != MAP_FAILED ? static_cast<const unsigned char *>(view) : nullptr;
+#endif
+    if (!data)
+    {
+      Close();
+      throw std::runtime_error("cannot map " + path);
+    }
+  }
+
+  ~MappedFile()
+  {
+    Close();
+  }
+
+  const unsigned char *GetData() const
+  {
+    return data;
+  }
+
+  size_t GetSize() const
+  {
+    return size;
+  }
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  void Close()
+  {
+#ifdef _WIN32
+    if (data)
+    {
+      UnmapViewOfFile(data);
+    }
+    if (mapping != NULL)
+    {
+      CloseHandle(mapping);
+    }
+    CloseHandle(file);
+#else
+    if (data)
+    {
+      munmap(const_cast<unsigned char *>(data), size);
+    }
+    close(file);
+#endif
+  }
+
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping = NULL;
+#else
+  int file;
+#endif
+  const unsigned char *data;
+  size_t size;
+};
+
+bool IsNrrdGzip(const NrrdHeader &header)
+{
+  return header.encoding == "gzip" || header.encoding == "gz";
+}
+
+// Why the data section of a nrrd can not be mapped as the volume buffer (raw) or inflated into it (gzip),
+// empty if it can
+std::string GetNrrdDataIssue(const NrrdHeader &header)
+{
+  int one = 1;
+  bool little_endian = *reinterpret_cast<char *>(&one) == 1;
+  int type_size = header.scalar_type ? vtkAbstractArray::GetDataTypeSize(header.scalar_type) : 0;
+
+  if (header.encoding != "raw" && !IsNrrdGzip(header))
+  {
+    return "encoding " + header.encoding;
+  }
+  if (IsNrrdGzip(header) && header.byte_skip != 0)
+  {
+    return "byte skip in gzip data";
+  }
+  if (!header.scalar_type || header.dimension != 3)
+  {
+    return "unsupported type or dimension";
+  }
+  if (type_size > 1 && (header.endian == "little") != little_endian)
+  {
+    return "endianness differs from this machine";
+  }
+  if (header.line_skip != 0 || header.data_file.compare(0, 4, "LIST") == 0 || header.data_file.find(' ') != std::string::npos)
+  {
+    return "line skip or multiple data files";
+  }
+  return "";
+}
+
+// Geometry of a nrrd volume (extent, spacing, origin) without scalars, as ReadNrrd will load it.
+// Only the header is read.
+vtkSmartPointer<vtkImageData> ReadNrrdInformation(const std::string &path)
+{
+  NrrdHeader header = ReadNrrdHeader(path);
+  vtkSmartPointer<vtkImageData> information = vtkSmartPointer<vtkImageData>::New();
+
+  if (GetNrrdDataIssue(header).empty())
+  {
+    information->SetDimensions(header.sizes);
+    information->SetSpacing(header.spacing);
+    information->SetOrigin(header.origin);
+  }
+  else
+  {
+    vtkSmartPointer<vtkNrrdReader> reader = vtkSmartPointer<vtkNrrdReader>::New();
+    reader->SetFileName(path.c_str());
+    reader->UpdateInformation();
+    information->SetExtent(reader->GetDataExtent());
+    information->SetSpacing(reader->GetDataSpacing());
+    information->SetOrigin(reader->GetDataOrigin());
+  }
+
+  return information;
+}
+
+// Inflate only the voxels of extent from gzip nrrd data into out, the scalars of the extent.
+// Members out of the extent slabs are skipped and a plain stream stops after the last row of the extent.
+bool InflateGzipExtent(const NrrdHeader &header, const int extent[6], const unsigned char *data, size_t size,
+                       unsigned char *out, int n_threads)
+{
+  size_t type_size = vtkAbstractArray::GetDataTypeSize(header.scalar_type);
+  size_t row_size = header.sizes[0] * type_size;
+  size_t slice_size = header.sizes[1] * row_size;
+  size_t x_begin = extent[0] * type_size;
+  size_t x_end = (extent[1] + 1) * type_size;
+  size_t rows = extent[3] - extent[2] + 1;
+  size_t begin = extent[4] * slice_size + extent[2] * row_size;
+  size_t end = extent[5] * slice_size + (extent[3] + 1) * row_size;
+
+  // copy the inflated bytes [offset, offset + n) of the volume that fall in the extent
+  auto copy = [&](size_t offset, const unsigned char *bytes, size_t n) {
+    for (size_t row = offset / row_size; row * row_size < offset + n; row++)
+    {
+      int j = int(row % header.sizes[1]);
+      int k = int(row / header.sizes[1]);
+      size_t first = std::max(row * row_size + x_begin, offset);
+      size_t last = std::min(row * row_size + x_end, offset + n);
+      if (j < extent[2] || j > extent[3] || k < extent[4] || k > extent[5] || first >= last)
+      {
+        continue;
+      }
+      size_t target = ((k - extent[4]) * rows + (j - extent[2])) * (x_end - x_begin) + (first - row * row_size - x_begin);
+      std::memcpy(out + target, bytes + (first - offset), last - first);
+    }
+  };
+
+  std::vector<GzipMember> members = GetGzipMembers(data, size);
+  if (members.size() < 2)
+  {
+    return InflateGzipChunks(data, size, end, copy);
+  }
+  if (members.back().output_offset + members.back().output_size < end)
+  {
+    return false;
+  }
+
+  std::atomic<bool> inflated(true);
+  ParallelFor(int(members.size()), n_threads, [&](int m) {
+    const GzipMember &member = members[m];
+    if (member.output_offset >= end || member.output_offset + member.output_size <= begin)
+    {
+      return;
+    }
+    std::vector<unsigned char> bytes(member.output_size);
+    if (!InflateGzipStream(data + member.offset, member.size, bytes.data(), bytes.size()))
+    {
+      inflated = false;
+      return;
+    }
+    copy(member.output_offset, bytes.data(), bytes.size());
+  });
+
+  return inflated;
+}
+
+// Read a nrrd volume. Raw data (attached or detached) is memory mapped and used as the scalars with no copy,
+// mapping then owns the memory and must outlive the image. Gzip data are inflated on n_threads threads
+// (0 = all cores) when written as independent members (see CompressNrrd). Other files are read by vtkNrrdReader.
+// extent (optional): only load these voxels. Mapped volumes stay whole, only the pages sampled are ever read.
+vtkSmartPointer<vtkImageData> ReadNrrd(const std::string &path, std::shared_ptr<MappedFile> &mapping, int n_threads,
+                                       const int *extent)
+{
+  NrrdHeader header = ReadNrrdHeader(path);
+  std::string issue = GetNrrdDataIssue(header);
+  bool gzip = IsNrrdGzip(header);
+  bool region = gzip && extent;
+
+  vtkIdType n = vtkIdType(header.sizes[0]) * header.sizes[1] * header.sizes[2];
+  long long bytes = (long long)(n) * (header.scalar_type ? vtkAbstractArray::GetDataTypeSize(header.scalar_type) : 0);
+  long long offset = 0;
+  std::shared_ptr<MappedFile> file;
+
+  if (issue.empty())
+  {
+    file = std::make_shared<MappedFile>(header.data_file.empty() ? path : GetNrrdDataPath(path, header.data_file));
+
+    // byte skip -1: the data are the last bytes of the file
+    offset = header.byte_skip == -1 ? (long long)file->GetSize() - bytes
+                                     : (header.data_file.empty() ? header.header_size : 0) + header.byte_skip;
+    if (offset < 0 || offset + (gzip ? 0 : bytes) > (long long)file->GetSize())
+    {
+      issue = "data section out of the file";
+    }
+    else if (!gzip && offset % vtkAbstractArray::GetDataTypeSize(header.scalar_type) != 0)
+    {
+      issue = "data section not aligned";
+    }
+  }
+
+  vtkSmartPointer<vtkDataArray> scalars;
+  if (issue.empty())
+  {
+    scalars = vtkSmartPointer<vtkDataArray>::Take(vtkDataArray::CreateDataArray(header.scalar_type));
+    scalars->SetNumberOfComponents(1);
+    scalars->SetName("ImageFile"); // as vtkNrrdReader names it
+
+    if (region)
+    {
+      scalars->SetNumberOfTuples(vtkIdType(extent[1] - extent[0] + 1) * (extent[3] - extent[2] + 1) * (extent[5] - extent[4] + 1));
+      if (!InflateGzipExtent(header, extent, file->GetData() + offset, file->GetSize() - offset,
+                             static_cast<unsigned char *>(scalars->GetVoidPointer(0)), n_threads))
+      {
+        issue = "corrupted gzip data";
+      }
+    }
+    else if (gzip)
+    {
+      // the members are inflated straight into the scalars, the compressed file is released after
+      scalars->SetNumberOfTuples(n);
+      if (!InflateGzip(file->GetData() + offset, file->GetSize() - offset,
+                       static_cast<unsigned char *>(scalars->GetVoidPointer(0)), size_t(bytes), n_threads))
+      {
+        issue = "corrupted gzip data";
+      }
+    }
+    else
+    {
+      // the mapping is read-only: the buffer is never written, only sampled
+      mapping = file;
+      scalars->SetVoidArray(const_cast<unsigned char *>(mapping->GetData() + offset), n, 1);
+    }
+  }
+
+  if (!issue.empty())
+  {
+    mapping.reset();
+    CMPR_LOG(LOG_INFO, "nrrd not mapped (" << issue << "), reading " << path);
+
+    vtkSmartPointer<vtkNrrdReader> reader = vtkSmartPointer<vtkNrrdReader>::New();
+    reader->SetFileName(path.c_str());
+    if (extent)
+    {
+      reader->UpdateExtent(extent);
+    }
+    else
+    {
+      reader->Update();
+    }
+    return reader->GetOutput();
+  }
+
+  vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+  if (region)
+  {
+    image->SetExtent(const_cast<int *>(extent));
+  }
+  else
+  {
+    image->SetDimensions(header.sizes);
+  }
+  image->SetSpacing(header.spacing);
+  image->SetOrigin(header.origin);
+  image->GetPointData()->SetScalars(scalars);
+
+  CMPR_LOG(LOG_DEBUG, (gzip ? "nrrd inflated: " : "nrrd mapped: ") << path);
+
+  return image;
+}
+
+// Write a nrrd volume as an attached gzip nrrd made of independent members of 64 KiB (as bgzip),
+// which ReadNrrd inflates in parallel. The file is still a plain gzip nrrd for any other reader.
+// The header fields are kept, except the encoding and data location.
+void CompressNrrd(const std::string &input, const std::string &output, int level, int n_threads)
+{
+  NrrdHeader header = ReadNrrdHeader(input);
+  if (!header.scalar_type || header.dimension != 3)
+  {
+    throw std::runtime_error("unsupported type or dimension: " + input);
+  }
+
+  std::shared_ptr<MappedFile> mapping;
+  vtkSmartPointer<vtkImageData> image = ReadNrrd(input, mapping, n_threads, nullptr);
+  vtkDataArray *scalars = image->GetPointData()->GetScalars();
+
+  std::ofstream file(output.c_str(), std::ios::binary);
+  if (!file)
+  {
+    throw std::runtime_error("cannot write " + output);
+  }
+
+  // the scalars are in memory, so in the machine endianness
+  int one = 1;
+  bool little_endian = *reinterpret_cast<char *>(&one) == 1;
+
+  file << "NRRD0004\n";
+  for (size_t l = 0; l < header.lines.size(); l++)
+  {
+    std::string field = header.lines[l].substr(0, header.lines[l].find(": "));
+    std::transform(field.begin(), field.end(), field.begin(), ::tolower);
+    if (field != "encoding" && field != "endian" && field != "data file" && field != "datafile" &&
+        field != "byte skip" && field != "byteskip" && field != "line skip" && field != "lineskip")
+    {
+      file << header.lines[l] << "\n";
+    }
+  }
+  file << "endian: " << (little_endian ? "little" : "big") << "\n";
+  file << "encoding: gzip\n\n";
+
+  DeflateGzipMembers(file, static_cast<const unsigned char *>(scalars->GetVoidPointer(0)),
+                     size_t(scalars->GetNumberOfValues()) * scalars->GetDataTypeSize(), level, n_threads);
+
+  if (!file)
+  {
+    throw std::runtime_error("cannot write " + output);
+  }
+}
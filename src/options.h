@@ -0,0 +1,82 @@
+// Sampling engine used to probe the volume with the cmpr and axial surfaces
+enum SamplerType
+{
+  SAMPLER_PROBE,    // vtkProbeFilter: generic cell locate per point
+  SAMPLER_TRILINEAR // direct trilinear interpolation on the image scalars
+};
+
+// Reduction of the samples across a thick slab into a single cmpr image
+enum SlabMode : int
+{
+  SLAB_NONE,  // one image per stack slice
+  SLAB_MIP,   // maximum intensity
+  SLAB_MINIP, // minimum intensity
+  SLAB_MEAN   // average intensity
+};
+
+// Scalar type of the returned pixels, an explicit VTK type or the scalar type of the volume
+enum PixelType
+{
+  PIXEL_NATIVE = 0,
+  PIXEL_INT8 = VTK_SIGNED_CHAR,
+  PIXEL_UINT8 = VTK_UNSIGNED_CHAR,
+  PIXEL_INT16 = VTK_SHORT,
+  PIXEL_UINT16 = VTK_UNSIGNED_SHORT,
+  PIXEL_INT32 = VTK_INT,
+  PIXEL_UINT32 = VTK_UNSIGNED_INT,
+  PIXEL_FLOAT32 = VTK_FLOAT,
+  PIXEL_FLOAT64 = VTK_DOUBLE
+};
+
+// Part of a straightened cmpr to sample (eg. the zoomed part shown by a viewer), in pixels of the whole cmpr where
+// pixel k covers [k, k + 1): rows and cols may be fractional, an empty range (end <= begin) is the whole axis.
+// The part is resampled to out_rows x out_cols pixels, 0 keeps one pixel per cmpr pixel.
+struct CmprViewport
+{
+  float row_begin = 0.0f;
+  float row_end = 0.0f;
+  float col_begin = 0.0f;
+  float col_end = 0.0f;
+  int slice_begin = 0;
+  int slice_end = 0;
+  unsigned int out_rows = 0;
+  unsigned int out_cols = 0;
+
+  bool IsSet() const
+  {
+    return row_end > row_begin || col_end > col_begin || slice_end > slice_begin || out_rows > 0 || out_cols > 0;
+  }
+};
+
+// Optional settings shared by every cmpr entry point
+struct CmprOptions
+{
+  SamplerType sampler = SAMPLER_TRILINEAR;
+  int threads = 0;                      // sampling threads, 0 = all cores, 1 = serial
+  PixelType pixel_type = PIXEL_FLOAT32; // interpolated values are rounded to integral types
+  bool load_roi = true;                 // compute_cmpr_*: only load the voxels around the sampled surfaces
+  std::string trace_file;               // write the stage timings of each request as a Chrome trace
+  float wwwl_percentile = 0.0f;         // 0: window over the full pixel range, p: over the [p, 100 - p] percentiles
+  // Volume sessions: a coarse cmpr of preview_resolution columns, sampled on the matching level of the volume
+  // pyramid, is handed to on_preview before the full resolution one is computed
+  std::function<void(CmprResult)> on_preview;
+  unsigned int preview_resolution = 64;
+  // slab: n_slices and dist_slices are replaced by slab_samples samples spread over slab_thickness (mm) along
+  // stack_direction, reduced while sampling into a single image (always sampled trilinear)
+  SlabMode slab = SLAB_NONE;
+  float slab_thickness = 5.0f;
+  int slab_samples = 10;
+  std::shared_ptr<CancelToken> cancel; // cancels the request from another thread, nullptr: not cancellable
+  // straightened cmprs: only the samples of the viewport are generated and probed, and only the axial frames of its rows
+  CmprViewport viewport;
+};
+
+// VTK scalar type of the pixels returned for an image
+int GetPixelType(const CmprOptions &options, vtkImageData *image)
+{
+  if (options.pixel_type == PIXEL_NATIVE)
+  {
+    return image->GetScalarType();
+  }
+  return int(options.pixel_type);
+}
@@ -0,0 +1,167 @@
+// Persistent worker pool shared by every cmpr request
+class ThreadPool
+{
+public:
+  ThreadPool(int n_threads) : stop(false)
+  {
+    for (int t = 0; t < n_threads; t++)
+    {
+      workers.push_back(std::thread([this] { Work(); }));
+    }
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stop = true;
+    }
+    condition.notify_all();
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+      workers[t].join();
+    }
+  }
+
+  void Enqueue(std::function<void()> task)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      tasks.push(task);
+    }
+    condition.notify_one();
+  }
+
+  int GetNumberOfThreads()
+  {
+    return int(workers.size());
+  }
+
+private:
+  void Work()
+  {
+    while (true)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return stop || !tasks.empty(); });
+        if (stop && tasks.empty())
+        {
+          return;
+        }
+        task = tasks.front();
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stop;
+};
+
+int GetHardwareThreads()
+{
+  int n_threads = int(std::thread::hardware_concurrency());
+  return n_threads > 0 ? n_threads : 1;
+}
+
+// The calling thread always takes part in the work, so the pool holds one thread less than the cores.
+// The pool is never destroyed: joining workers while the module is unloaded can deadlock.
+ThreadPool &GetThreadPool()
+{
+  static ThreadPool *pool = new ThreadPool(GetHardwareThreads() - 1);
+  return *pool;
+}
+
+// Items of a ParallelFor, claimed one at a time by the caller and the pool helpers
+struct ParallelState
+{
+  ParallelState(int n) : n_items(n), next(0), done(0), failed(false), cancel(GetThreadCancelToken()) {}
+
+  int n_items;
+  std::atomic<int> next;
+  std::atomic<int> done;
+  std::atomic<bool> failed;
+  std::exception_ptr error;
+  std::shared_ptr<CancelToken> cancel; // token of the caller, also checked by the helpers
+  std::mutex mutex;
+  std::condition_variable finished;
+};
+
+void RunParallelItems(std::shared_ptr<ParallelState> state, const std::function<void(int)> &body)
+{
+  CancelScope cancel_scope(state->cancel);
+  int item;
+  while ((item = state->next++) < state->n_items)
+  {
+    // after a failure the remaining items are only counted, not processed
+    if (!state->failed)
+    {
+      try
+      {
+        CheckCancelled();
+        body(item);
+      }
+      catch (...)
+      {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (!state->error)
+        {
+          state->error = std::current_exception();
+        }
+        state->failed = true;
+      }
+    }
+
+    if (++state->done == state->n_items)
+    {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->finished.notify_all();
+    }
+  }
+}
+
+// Run body(item) for every item in [0, n_items) on up to n_threads threads (0 = all cores).
+// Each item is processed exactly once, so the output does not depend on the thread count.
+// Once the request of the caller is cancelled, the remaining items are skipped and CmprCancelled is thrown.
+void ParallelFor(int n_items, int n_threads, std::function<void(int)> body)
+{
+  if (n_threads <= 0)
+  {
+    n_threads = GetHardwareThreads();
+  }
+  int helpers = std::min(std::min(n_threads, n_items) - 1, GetThreadPool().GetNumberOfThreads());
+
+  if (helpers <= 0)
+  {
+    for (int item = 0; item < n_items; item++)
+    {
+      CheckCancelled();
+      body(item);
+    }
+    return;
+  }
+
+  std::shared_ptr<ParallelState> state = std::make_shared<ParallelState>(n_items);
+  for (int h = 0; h < helpers; h++)
+  {
+    GetThreadPool().Enqueue([state, body] { RunParallelItems(state, body); });
+  }
+  RunParallelItems(state, body);
+
+  // wait for the items claimed by the helpers
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state] { return state->done == state->n_items; });
+  }
+
+  if (state->error)
+  {
+    std::rethrow_exception(state->error);
+  }
+}
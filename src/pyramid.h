@@ -0,0 +1,88 @@
+// Smallest side of a pyramid level, coarser levels are not built
+const int PYRAMID_MIN_SIDE = 16;
+
+// Every voxel of the level is the mean of the 2x2x2 voxels of the image it covers
+template <class TScalar>
+void DownsampleImageTyped(vtkImageData *image, vtkImageData *level, int n_threads)
+{
+  const TScalar *scalars = static_cast<const TScalar *>(image->GetScalarPointer());
+  TScalar *out = static_cast<TScalar *>(level->GetScalarPointer());
+  int *dims = image->GetDimensions();
+  int *level_dims = level->GetDimensions();
+  vtkIdType slice = vtkIdType(dims[0]) * dims[1];
+
+  ParallelFor(level_dims[2], n_threads, [&](int k) {
+    for (int j = 0; j < level_dims[1]; j++)
+    {
+      const TScalar *row = scalars + 2 * k * slice + vtkIdType(2 * j) * dims[0];
+      TScalar *level_row = out + (vtkIdType(k) * level_dims[1] + j) * level_dims[0];
+      for (int i = 0; i < level_dims[0]; i++)
+      {
+        const TScalar *p = row + 2 * i;
+        double sum = double(p[0]) + p[1] + p[dims[0]] + p[dims[0] + 1] +
+                     p[slice] + p[slice + 1] + p[slice + dims[0]] + p[slice + dims[0] + 1];
+        level_row[i] = CastPixel<TScalar>(sum / 8.0);
+      }
+    }
+  });
+}
+
+// Half resolution copy of an image, same scalar type. An odd last voxel is dropped so that every level voxel
+// lies exactly at the center of the voxels it averages.
+vtkSmartPointer<vtkImageData> DownsampleImage(vtkImageData *image, int n_threads)
+{
+  int *dims = image->GetDimensions();
+  double *spacing = image->GetSpacing();
+  double *origin = image->GetOrigin();
+
+  vtkSmartPointer<vtkImageData> level = vtkSmartPointer<vtkImageData>::New();
+  level->SetDimensions(dims[0] / 2, dims[1] / 2, dims[2] / 2);
+  level->SetSpacing(2 * spacing[0], 2 * spacing[1], 2 * spacing[2]);
+  level->SetOrigin(origin[0] + spacing[0] / 2, origin[1] + spacing[1] / 2, origin[2] + spacing[2] / 2);
+  level->AllocateScalars(image->GetScalarType(), 1);
+  level->GetPointData()->GetScalars()->SetName("ImageFile"); // as vtkNrrdReader names it
+
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(DownsampleImageTyped<VTK_TT>(image, level, n_threads));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << image->GetScalarType());
+  }
+
+  return level;
+}
+
+// Mip levels of an image: level 0 is the image itself, every next level halves the previous one
+// while its smallest side stays above PYRAMID_MIN_SIDE
+std::vector<vtkSmartPointer<vtkImageData>> CreatePyramid(vtkImageData *image, int n_threads)
+{
+  std::vector<vtkSmartPointer<vtkImageData>> pyramid(1, image);
+  int *dims = image->GetDimensions();
+  int side = std::min(dims[0], std::min(dims[1], dims[2]));
+
+  for (side /= 2; side >= PYRAMID_MIN_SIDE; side /= 2)
+  {
+    pyramid.push_back(DownsampleImage(pyramid.back(), n_threads));
+  }
+
+  CMPR_LOG(LOG_DEBUG, "pyramid of " << pyramid.size() << " levels");
+
+  return pyramid;
+}
+
+// Coarsest level whose voxels are not larger than the output pixels: sampling it at that spacing
+// loses nothing more than sampling the full resolution image
+int GetPyramidLevel(const std::vector<vtkSmartPointer<vtkImageData>> &pyramid, double output_spacing)
+{
+  double *spacing = pyramid[0]->GetSpacing();
+  double voxel = std::max(spacing[0], std::max(spacing[1], spacing[2]));
+
+  int level = 0;
+  while (level + 1 < int(pyramid.size()) && voxel * 2 <= output_spacing)
+  {
+    voxel *= 2;
+    level++;
+  }
+
+  return level;
+}
@@ -0,0 +1,121 @@
+// Pixel values stored in a VTK scalar type (VTK_FLOAT, VTK_SHORT, ...)
+struct PixelBuffer
+{
+  PixelBuffer() : type(VTK_FLOAT), size(0) {}
+  PixelBuffer(int type, size_t size)
+      : type(type), size(size), bytes(size * vtkAbstractArray::GetDataTypeSize(type)) {}
+
+  template <class T>
+  T *GetPointer()
+  {
+    return reinterpret_cast<T *>(bytes.data());
+  }
+
+  template <class T>
+  const T *GetPointer() const
+  {
+    return reinterpret_cast<const T *>(bytes.data());
+  }
+
+  size_t GetElementSize() const
+  {
+    return size_t(vtkAbstractArray::GetDataTypeSize(type));
+  }
+
+  int type;
+  size_t size;                      // number of values
+  std::vector<unsigned char> bytes; // size * element size
+};
+
+// Convert a sample to the pixel type: integral types are rounded half away from zero and clamped to their range
+template <class TPixel>
+inline TPixel CastPixel(double value)
+{
+  if (std::numeric_limits<TPixel>::is_integer)
+  {
+    value = value >= 0.0 ? value + 0.5 : value - 0.5;
+    value = std::min(std::max(value, double(std::numeric_limits<TPixel>::lowest())),
+                     double(std::numeric_limits<TPixel>::max()));
+  }
+  return TPixel(value);
+}
+
+// Bins of the pixel histograms, spread over the scalar range of the volume
+const int HISTOGRAM_BINS = 2048;
+
+// Range and histogram of pixels, accumulated while the pixels are written so that the window needs no other pass
+struct PixelStats
+{
+  PixelStats() : low(0.0), high(0.0), scale(0.0), min(std::numeric_limits<double>::max()), max(std::numeric_limits<double>::lowest()), count(0) {}
+  PixelStats(double low, double high)
+      : low(low), high(high), scale(high > low ? HISTOGRAM_BINS / (high - low) : 0.0),
+        min(std::numeric_limits<double>::max()), max(std::numeric_limits<double>::lowest()), count(0), histogram(HISTOGRAM_BINS, 0) {}
+
+  // values out of [low, high] (eg. probed points outside the volume) fall in the first or last bin
+  void Add(double value)
+  {
+    min = std::min(min, value);
+    max = std::max(max, value);
+    double bin = (value - low) * scale;
+    histogram[bin > 0.0 ? (bin < HISTOGRAM_BINS ? int(bin) : HISTOGRAM_BINS - 1) : 0]++;
+    count++;
+  }
+
+  // Same bins, nothing counted: stats of a block of samples, merged when the block is done
+  PixelStats GetEmpty() const
+  {
+    return PixelStats(low, high);
+  }
+
+  void Merge(const PixelStats &other)
+  {
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+    for (int b = 0; b < HISTOGRAM_BINS; b++)
+    {
+      histogram[b] += other.histogram[b];
+    }
+  }
+
+  // Value under which percent % of the pixels lie, linear within a bin
+  double GetPercentile(double percent) const
+  {
+    if (count == 0 || scale == 0.0)
+    {
+      return min;
+    }
+
+    double target = percent / 100.0 * count;
+    size_t below = 0;
+    for (int b = 0; b < HISTOGRAM_BINS; b++)
+    {
+      if (histogram[b] > 0 && below + histogram[b] >= target)
+      {
+        double value = low + (b + (target - below) / histogram[b]) / scale;
+        return std::min(std::max(value, min), max);
+      }
+      below += histogram[b];
+    }
+    return max;
+  }
+
+  double low;
+  double high;
+  double scale; // bins per scalar unit
+  double min;
+  double max;
+  size_t count;
+  std::vector<size_t> histogram;
+};
+
+// Response of a cmpr request: pixel buffers are kept apart from the small fields
+// so that they can be handed over to numpy without copies
+struct CmprResult
+{
+  PixelBuffer pixels_cmpr;
+  PixelBuffer pixels_axial;
+  std::map<std::string, std::vector<float>> fields; // metadata, dimension_*, spacing_*, wwwl_*, iop_axial, ipp_axial
+  std::vector<StageTiming> timings;
+  std::shared_ptr<CmprMapping> mapping; // pixel <-> world points of this response
+};
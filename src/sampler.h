@@ -0,0 +1,495 @@
+// Points handed to the batch kernels at once
+const int SAMPLE_BATCH = 256;
+
+// Sample points [begin, end) of n, shifted by offset, and count the written pixels in stats if given
+template <class TScalar, class TPoint, class TPixel>
+void SamplePoints(const ImageGrid<TScalar> &grid, const TPoint *pts, vtkIdType begin, vtkIdType end, vtkIdType n, const double offset[3], TPixel *out, bool reverse, PixelStats *stats)
+{
+  double x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH], values[SAMPLE_BATCH];
+  int level = GetSimdLevel();
+
+  for (vtkIdType b = begin; b < end; b += SAMPLE_BATCH)
+  {
+    int m = int(std::min(end - b, vtkIdType(SAMPLE_BATCH)));
+    for (int k = 0; k < m; k++)
+    {
+      const TPoint *p = pts + 3 * (b + k);
+      x[k] = p[0] + offset[0];
+      y[k] = p[1] + offset[1];
+      z[k] = p[2] + offset[2];
+    }
+
+    SampleTrilinearBatch(grid, x, y, z, m, values, level);
+    for (int k = 0; k < m; k++)
+    {
+      vtkIdType i = b + k;
+      TPixel pixel = CastPixel<TPixel>(values[k]);
+      out[reverse ? n - 1 - i : i] = pixel;
+      if (stats)
+      {
+        stats->Add(double(pixel));
+      }
+    }
+  }
+}
+
+// Every block counts its pixels apart, its stats are merged into the stats of the request when it is done
+void MergePixelStats(PixelStats *stats, const PixelStats &block_stats, std::mutex &mutex)
+{
+  if (stats)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stats->Merge(block_stats);
+  }
+}
+
+// Size of the blocks handed to the threads: a few slices are not enough to keep every thread busy, split them further
+vtkIdType GetBlockSize(vtkIdType n, vtkIdType block, int n_threads)
+{
+  int threads = n_threads > 0 ? n_threads : GetHardwareThreads();
+  block = std::max(std::min(block, n), vtkIdType(1));
+  while (block > 1024 && (n + block - 1) / block < 4 * threads)
+  {
+    block = (block + 1) / 2;
+  }
+
+  return block;
+}
+
+// Split the points in blocks (a stack slice or an axial frame) and sample them across the thread pool
+template <class TScalar, class TPoint, class TPixel>
+void SamplePointsParallel(const ImageGrid<TScalar> &grid, const TPoint *pts, vtkIdType n, TPixel *out, bool reverse, vtkIdType block, int n_threads, PixelStats *stats)
+{
+  const double no_offset[3] = {0.0, 0.0, 0.0};
+  std::mutex stats_mutex;
+
+  block = GetBlockSize(n, block, n_threads);
+  int n_blocks = int((n + block - 1) / block);
+  ParallelFor(n_blocks, n_threads, [&](int b) {
+    PixelStats block_stats = stats ? stats->GetEmpty() : PixelStats();
+    SamplePoints(grid, pts, b * block, std::min((b + 1) * block, n), n, no_offset, out, reverse, stats ? &block_stats : nullptr);
+    MergePixelStats(stats, block_stats, stats_mutex);
+  });
+}
+
+// Sample points [begin, end) of every slice of an implicit stack of n points per slice:
+// slice s is the master slice shifted by its offset
+template <class TScalar, class TPoint, class TPixel>
+void SampleStackParallel(const ImageGrid<TScalar> &grid, const TPoint *pts, vtkIdType n, vtkIdType begin, vtkIdType end,
+                         const std::vector<double> &offsets, TPixel *out, int n_threads, PixelStats *stats)
+{
+  std::mutex stats_mutex;
+  int n_slices = int(offsets.size() / 3);
+  vtkIdType block = GetBlockSize((end - begin) * n_slices, end - begin, n_threads);
+  int blocks_per_slice = int((end - begin + block - 1) / block);
+
+  ParallelFor(n_slices * blocks_per_slice, n_threads, [&](int b) {
+    int slice = b / blocks_per_slice;
+    vtkIdType first = begin + (b % blocks_per_slice) * block;
+    PixelStats block_stats = stats ? stats->GetEmpty() : PixelStats();
+    SamplePoints(grid, pts, first, std::min(first + block, end), n, &offsets[3 * slice], out + slice * n, false, stats ? &block_stats : nullptr);
+    MergePixelStats(stats, block_stats, stats_mutex);
+  });
+}
+
+template <class TScalar, class TPixel>
+void SampleImageTyped(vtkImageData *image, vtkPoints *points, TPixel *out, bool reverse, vtkIdType block, int n_threads, PixelStats *stats)
+{
+  ImageGrid<TScalar> grid = GetImageGrid<TScalar>(image);
+  vtkIdType n = points->GetNumberOfPoints();
+
+  if (points->GetDataType() == VTK_DOUBLE)
+  {
+    SamplePointsParallel(grid, static_cast<const double *>(points->GetVoidPointer(0)), n, out, reverse, block, n_threads, stats);
+  }
+  else
+  {
+    SamplePointsParallel(grid, static_cast<const float *>(points->GetVoidPointer(0)), n, out, reverse, block, n_threads, stats);
+  }
+}
+
+template <class TPixel>
+void SampleImageInto(vtkImageData *image, vtkPoints *points, TPixel *out, bool reverse, vtkIdType block, int n_threads, PixelStats *stats)
+{
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(SampleImageTyped<VTK_TT>(image, points, out, reverse, block, n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << image->GetScalarType());
+  }
+}
+
+// Sample the image at every point, same values and ordering as GetPixelValues on a probe output.
+// Points are processed in blocks of block points (one stack slice or axial frame) on n_threads threads,
+// the stats of the pixels are accumulated while sampling when stats is given.
+PixelBuffer SampleImage(vtkImageData *image, vtkPoints *points, int type, bool reverse, vtkIdType block, int n_threads, PixelStats *stats)
+{
+  PixelBuffer values(type, points->GetNumberOfPoints());
+
+  switch (type)
+  {
+    vtkTemplateMacro(SampleImageInto(image, points, values.GetPointer<VTK_TT>(), reverse, block, n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported pixel type " << type);
+  }
+
+  CMPR_LOG(LOG_DEBUG, "array filled with " << values.size << " elements. ");
+
+  return values;
+}
+
+template <class TPoint, class TPixel>
+void SampleStackInto(vtkImageData *image, const TPoint *points, vtkIdType n, vtkIdType begin, vtkIdType end,
+                     const std::vector<double> &offsets, TPixel *out, int n_threads, PixelStats *stats)
+{
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(SampleStackParallel(GetImageGrid<VTK_TT>(image), points, n, begin, end, offsets, out, n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << image->GetScalarType());
+  }
+}
+
+template <class TPoint>
+void SampleStackPoints(vtkImageData *image, const TPoint *points, vtkIdType n, vtkIdType begin, vtkIdType end,
+                       const std::vector<double> &offsets, PixelBuffer &out, int n_threads, PixelStats *stats)
+{
+  switch (out.type)
+  {
+    vtkTemplateMacro(SampleStackInto(image, points, n, begin, end, offsets, out.GetPointer<VTK_TT>(), n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported pixel type " << out.type);
+  }
+}
+
+// Resample points [begin, end) of every slice of a stack of n master points into out (slices x n values)
+void SampleStackRange(vtkImageData *image, const float *points, vtkIdType n, vtkIdType begin, vtkIdType end,
+                      const std::vector<double> &offsets, PixelBuffer &out, int n_threads)
+{
+  SampleStackPoints(image, points, n, begin, end, offsets, out, n_threads, nullptr);
+}
+
+// Sample an implicit stack, same values and ordering as sampling its squashed polydata
+PixelBuffer SampleStack(vtkImageData *image, const ImplicitStack &stack, int type, int n_threads, PixelStats *stats)
+{
+  vtkIdType n = stack.points->GetNumberOfPoints();
+  PixelBuffer values(type, n * (stack.offsets.size() / 3));
+
+  if (stack.points->GetDataType() == VTK_DOUBLE)
+  {
+    SampleStackPoints(image, static_cast<const double *>(stack.points->GetVoidPointer(0)), n, 0, n, stack.offsets, values, n_threads, stats);
+  }
+  else
+  {
+    SampleStackPoints(image, static_cast<const float *>(stack.points->GetVoidPointer(0)), n, 0, n, stack.offsets, values, n_threads, stats);
+  }
+
+  CMPR_LOG(LOG_DEBUG, "array filled with " << values.size << " elements. ");
+
+  return values;
+}
+
+inline double ReduceSlab(SlabMode mode, double slab, double value)
+{
+  switch (mode)
+  {
+  case SLAB_MIP:
+    return std::max(slab, value);
+  case SLAB_MINIP:
+    return std::min(slab, value);
+  default:
+    return slab + value;
+  }
+}
+
+// Sample every point of the master slice at every slab offset and reduce the samples on the fly:
+// one output value per point, the slab samples are never stored
+template <class TScalar, class TPoint, class TPixel>
+void SampleSlabParallel(const ImageGrid<TScalar> &grid, const TPoint *pts, vtkIdType n, const std::vector<double> &offsets,
+                        SlabMode mode, TPixel *out, int n_threads, PixelStats *stats)
+{
+  std::mutex stats_mutex;
+  int n_samples = int(offsets.size() / 3);
+  vtkIdType block = GetBlockSize(n, n, n_threads);
+  int n_blocks = int((n + block - 1) / block);
+
+  ParallelFor(n_blocks, n_threads, [&](int bl) {
+    double x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH], values[SAMPLE_BATCH], slab[SAMPLE_BATCH];
+    int level = GetSimdLevel();
+    PixelStats block_stats = stats ? stats->GetEmpty() : PixelStats();
+    vtkIdType end = std::min((bl + 1) * block, n);
+
+    for (vtkIdType b = bl * block; b < end; b += SAMPLE_BATCH)
+    {
+      int m = int(std::min(end - b, vtkIdType(SAMPLE_BATCH)));
+      for (int s = 0; s < n_samples; s++)
+      {
+        const double *offset = &offsets[3 * s];
+        for (int k = 0; k < m; k++)
+        {
+          const TPoint *p = pts + 3 * (b + k);
+          x[k] = p[0] + offset[0];
+          y[k] = p[1] + offset[1];
+          z[k] = p[2] + offset[2];
+        }
+
+        SampleTrilinearBatch(grid, x, y, z, m, values, level);
+        for (int k = 0; k < m; k++)
+        {
+          slab[k] = s == 0 ? values[k] : ReduceSlab(mode, slab[k], values[k]);
+        }
+      }
+
+      for (int k = 0; k < m; k++)
+      {
+        TPixel pixel = CastPixel<TPixel>(mode == SLAB_MEAN ? slab[k] / n_samples : slab[k]);
+        out[b + k] = pixel;
+        if (stats)
+        {
+          block_stats.Add(double(pixel));
+        }
+      }
+    }
+    MergePixelStats(stats, block_stats, stats_mutex);
+  });
+}
+
+template <class TPoint, class TPixel>
+void SampleSlabInto(vtkImageData *image, const TPoint *points, vtkIdType n, const std::vector<double> &offsets, SlabMode mode,
+                    TPixel *out, int n_threads, PixelStats *stats)
+{
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(SampleSlabParallel(GetImageGrid<VTK_TT>(image), points, n, offsets, mode, out, n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << image->GetScalarType());
+  }
+}
+
+template <class TPoint>
+void SampleSlabPoints(vtkImageData *image, const TPoint *points, vtkIdType n, const std::vector<double> &offsets, SlabMode mode,
+                      PixelBuffer &out, int n_threads, PixelStats *stats)
+{
+  switch (out.type)
+  {
+    vtkTemplateMacro(SampleSlabInto(image, points, n, offsets, mode, out.GetPointer<VTK_TT>(), n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported pixel type " << out.type);
+  }
+}
+
+// Sample a slab (CreateSlab) reduced to a single image of the master slice points
+PixelBuffer SampleSlab(vtkImageData *image, const ImplicitStack &slab, SlabMode mode, int type, int n_threads, PixelStats *stats)
+{
+  vtkIdType n = slab.points->GetNumberOfPoints();
+  PixelBuffer values(type, n);
+
+  if (slab.points->GetDataType() == VTK_DOUBLE)
+  {
+    SampleSlabPoints(image, static_cast<const double *>(slab.points->GetVoidPointer(0)), n, slab.offsets, mode, values, n_threads, stats);
+  }
+  else
+  {
+    SampleSlabPoints(image, static_cast<const float *>(slab.points->GetVoidPointer(0)), n, slab.offsets, mode, values, n_threads, stats);
+  }
+
+  CMPR_LOG(LOG_DEBUG, "slab of " << slab.offsets.size() / 3 << " samples reduced to " << values.size << " elements. ");
+
+  return values;
+}
+
+// Sample axial frames [first, last), each plane generated from its basis while sampling.
+// Work is split per frame, and per row chunk when there are few frames.
+template <class TScalar, class TPixel>
+void SampleAxialFramesTyped(vtkImageData *image, const AxialFrames &frames, int first, int last, TPixel *out, bool reverse, int n_threads, PixelStats *stats)
+{
+  std::mutex stats_mutex;
+  ImageGrid<TScalar> grid = GetImageGrid<TScalar>(image);
+  int side = frames.resolution + 1;
+  vtkIdType m = vtkIdType(side) * side;
+  vtkIdType n = m * (last - first);
+
+  int rows_per_block = int(std::max(GetBlockSize(n, m, n_threads) / side, vtkIdType(1)));
+  int blocks_per_frame = (side + rows_per_block - 1) / rows_per_block;
+
+  ParallelFor((last - first) * blocks_per_frame, n_threads, [&](int b) {
+    int frame = b / blocks_per_frame;
+    int row_begin = (b % blocks_per_frame) * rows_per_block;
+    int row_end = std::min(row_begin + rows_per_block, side);
+    const double *basis = &frames.basis[9 * (first + frame)];
+    double p[3];
+    double x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH], values[SAMPLE_BATCH];
+    int level = GetSimdLevel();
+    PixelStats block_stats = stats ? stats->GetEmpty() : PixelStats();
+
+    for (int j = row_begin; j < row_end; j++)
+    {
+      for (int i0 = 0; i0 < side; i0 += SAMPLE_BATCH)
+      {
+        int count = std::min(side - i0, SAMPLE_BATCH);
+        for (int c = 0; c < count; c++)
+        {
+          GetAxialPoint(basis, frames.spacing, i0 + c, j, p);
+          x[c] = p[0];
+          y[c] = p[1];
+          z[c] = p[2];
+        }
+
+        SampleTrilinearBatch(grid, x, y, z, count, values, level);
+        vtkIdType k = frame * m + vtkIdType(j) * side + i0;
+        for (int c = 0; c < count; c++, k++)
+        {
+          TPixel pixel = CastPixel<TPixel>(values[c]);
+          out[reverse ? n - 1 - k : k] = pixel;
+          if (stats)
+          {
+            block_stats.Add(double(pixel));
+          }
+        }
+      }
+    }
+    MergePixelStats(stats, block_stats, stats_mutex);
+  });
+}
+
+template <class TPixel>
+void SampleAxialFramesInto(vtkImageData *image, const AxialFrames &frames, int first, int last, TPixel *out, bool reverse, int n_threads, PixelStats *stats)
+{
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(SampleAxialFramesTyped<VTK_TT>(image, frames, first, last, out, reverse, n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << image->GetScalarType());
+  }
+}
+
+// Sample axial frames [first, last), same values and ordering as sampling their squashed planes
+PixelBuffer SampleAxialFrames(vtkImageData *image, const AxialFrames &frames, int first, int last, int type, bool reverse, int n_threads, PixelStats *stats)
+{
+  int side = frames.resolution + 1;
+  PixelBuffer values(type, vtkIdType(side) * side * (last - first));
+
+  switch (type)
+  {
+    vtkTemplateMacro(SampleAxialFramesInto(image, frames, first, last, values.GetPointer<VTK_TT>(), reverse, n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported pixel type " << type);
+  }
+
+  return values;
+}
+
+// Sample the surfaces of a rotational cmpr, each one swept while sampling as SweepRows does (same float points):
+// row r of angle a goes through spline point r along directions[a][r]. Work is split per angle and row chunk.
+template <class TScalar, class TPixel>
+void SampleRotationalTyped(vtkImageData *image, const std::vector<double> &line, const std::vector<double> &directions,
+                           double distance, int cols, TPixel *out, int n_threads, PixelStats *stats)
+{
+  ImageGrid<TScalar> grid = GetImageGrid<TScalar>(image);
+  std::mutex stats_mutex;
+  int rows = int(line.size() / 3);
+  if (rows == 0)
+  {
+    return;
+  }
+  int n_angles = int(directions.size() / line.size());
+  vtkIdType n = vtkIdType(rows) * cols;
+  double spacing = distance / cols;
+
+  int rows_per_block = int(std::max(GetBlockSize(n * n_angles, n, n_threads) / cols, vtkIdType(1)));
+  int blocks_per_angle = (rows + rows_per_block - 1) / rows_per_block;
+
+  ParallelFor(n_angles * blocks_per_angle, n_threads, [&](int b) {
+    int angle = b / blocks_per_angle;
+    int row_begin = (b % blocks_per_angle) * rows_per_block;
+    int row_end = std::min(row_begin + rows_per_block, rows);
+    double x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH], values[SAMPLE_BATCH];
+    int level = GetSimdLevel();
+    PixelStats block_stats = stats ? stats->GetEmpty() : PixelStats();
+
+    for (int row = row_begin; row < row_end; row++)
+    {
+      const double *p = &line[3 * row];
+      const double *direction = &directions[3 * (vtkIdType(angle) * rows + row)];
+      for (int c0 = 0; c0 < cols; c0 += SAMPLE_BATCH)
+      {
+        int count = std::min(cols - c0, SAMPLE_BATCH);
+        for (int c = 0; c < count; c++)
+        {
+          int col = c0 + c - cols / 2;
+          x[c] = float(p[0] + direction[0] * col * spacing);
+          y[c] = float(p[1] + direction[1] * col * spacing);
+          z[c] = float(p[2] + direction[2] * col * spacing);
+        }
+
+        SampleTrilinearBatch(grid, x, y, z, count, values, level);
+        TPixel *row_out = out + angle * n + vtkIdType(row) * cols + c0;
+        for (int c = 0; c < count; c++)
+        {
+          TPixel pixel = CastPixel<TPixel>(values[c]);
+          row_out[c] = pixel;
+          if (stats)
+          {
+            block_stats.Add(double(pixel));
+          }
+        }
+      }
+    }
+    MergePixelStats(stats, block_stats, stats_mutex);
+  });
+}
+
+template <class TPixel>
+void SampleRotationalInto(vtkImageData *image, const std::vector<double> &line, const std::vector<double> &directions,
+                          double distance, int cols, TPixel *out, int n_threads, PixelStats *stats)
+{
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(SampleRotationalTyped<VTK_TT>(image, line, directions, distance, cols, out, n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << image->GetScalarType());
+  }
+}
+
+// Rotational cmpr pixels, angles x rows x cols: one straightened surface per set of rotated sweep directions
+// (RotateSweepDirections), the rows being the first points of the spline
+PixelBuffer SampleRotational(vtkImageData *image, vtkPolyData *spline, const std::vector<double> &directions,
+                             double distance, int cols, int type, int n_threads, PixelStats *stats)
+{
+  int rows = int(spline->GetNumberOfPoints()) - 1;
+  std::vector<double> line(3 * std::max(rows, 0));
+  for (int row = 0; row < rows; row++)
+  {
+    spline->GetPoint(row, &line[3 * row]);
+  }
+
+  PixelBuffer values(type, directions.size() / 3 * cols);
+
+  switch (type)
+  {
+    vtkTemplateMacro(SampleRotationalInto(image, line, directions, distance, cols, values.GetPointer<VTK_TT>(), n_threads, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported pixel type " << type);
+  }
+
+  return values;
+}
+
+// vtkProbeFilter updates the pipeline information of its source: probes of a shared volume take turns
+std::mutex &GetProbeMutex()
+{
+  static std::mutex mutex;
+  return mutex;
+}
+
+// Probe the image with a dataset through vtkProbeFilter
+vtkSmartPointer<vtkProbeFilter> ProbeImage(vtkImageData *image, vtkPolyData *surface)
+{
+  std::unique_lock<std::mutex> lock(GetProbeMutex());
+  vtkSmartPointer<vtkProbeFilter> probe = vtkSmartPointer<vtkProbeFilter>::New();
+  probe->SetSourceData(image);
+  probe->SetInputData(0, surface);
+  probe->Update();
+
+  return probe;
+}
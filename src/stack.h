@@ -1,13 +1,28 @@
+// Stack of slices stored as the master slice points plus one xyz offset per slice
+struct ImplicitStack
+{
+  vtkSmartPointer<vtkPoints> points;
+  std::vector<double> offsets;
+};
+
+// Cross-sectional planes along a spline, stored as a basis table
+struct AxialFrames
+{
+  std::vector<double> basis; // per frame: ipp xyz, u xyz, v xyz
+  int resolution;            // cells per side, (resolution + 1)^2 samples per plane
+  double spacing;            // distance between samples
+};
+
 std::vector<float> GetMetadata(vtkImageData *image)
 {
   // Store the image and print some infos
-  std::cout << "ORIGIN: "
-            << image->GetOrigin()[0] << ", " << image->GetOrigin()[1] << ", " << image->GetOrigin()[2] << std::endl
-            << "DIMENSION: "
-            << image->GetDimensions()[0] << ", " << image->GetDimensions()[1] << ", " << image->GetDimensions()[2] << std::endl
-            << "BOUNDS: "
-            << image->GetBounds()[0] << ", " << image->GetBounds()[1] << ", " << image->GetBounds()[2] << std::endl
-            << image->GetBounds()[3] << ", " << image->GetBounds()[4] << ", " << image->GetBounds()[5] << std::endl;
+  CMPR_LOG(LOG_DEBUG, "ORIGIN: "
+                          << image->GetOrigin()[0] << ", " << image->GetOrigin()[1] << ", " << image->GetOrigin()[2] << std::endl
+                          << "DIMENSION: "
+                          << image->GetDimensions()[0] << ", " << image->GetDimensions()[1] << ", " << image->GetDimensions()[2] << std::endl
+                          << "BOUNDS: "
+                          << image->GetBounds()[0] << ", " << image->GetBounds()[1] << ", " << image->GetBounds()[2] << std::endl
+                          << image->GetBounds()[3] << ", " << image->GetBounds()[4] << ", " << image->GetBounds()[5]);
 
   std::vector<float> metadata;
 
@@ -27,13 +42,86 @@ std::vector<float> GetMetadata(vtkImageData *image)
   return metadata;
 }
 
+// Voxel extent covering world bounds, plus margin voxels on each side, clamped to the image extent.
+// Empty bounds give the whole extent.
+void GetBoundsExtent(vtkImageData *image, const double bounds[6], int margin, int extent[6])
+{
+  const int *whole = image->GetExtent();
+  for (int a = 0; a < 3; a++)
+  {
+    extent[2 * a] = whole[2 * a];
+    extent[2 * a + 1] = whole[2 * a + 1];
+    if (bounds[2 * a] > bounds[2 * a + 1])
+    {
+      continue;
+    }
+
+    double origin = image->GetOrigin()[a];
+    double spacing = image->GetSpacing()[a];
+    double first = std::floor((bounds[2 * a] - origin) / spacing) - margin;
+    double last = std::ceil((bounds[2 * a + 1] - origin) / spacing) + margin;
+    extent[2 * a] = int(std::min(std::max(first, double(whole[2 * a])), double(whole[2 * a + 1])));
+    extent[2 * a + 1] = int(std::min(std::max(last, double(whole[2 * a])), double(whole[2 * a + 1])));
+  }
+}
+
+template <class TScalar>
+void GetExtentScalarRangeTyped(vtkImageData *image, const int extent[6], int n_threads, double range[2])
+{
+  const TScalar *scalars = static_cast<const TScalar *>(image->GetScalarPointer());
+  const int *whole = image->GetExtent();
+  vtkIdType row_size = vtkIdType(whole[1] - whole[0] + 1);
+  vtkIdType slice_size = row_size * (whole[3] - whole[2] + 1);
+  int n_slices = extent[5] - extent[4] + 1;
+
+  // range of every slice, merged once all are scanned
+  std::vector<double> low(n_slices);
+  std::vector<double> high(n_slices);
+  ParallelFor(n_slices, n_threads, [&](int s) {
+    const TScalar *slice = scalars + (extent[4] + s - whole[4]) * slice_size + (extent[0] - whole[0]);
+    TScalar min_value = slice[(extent[2] - whole[2]) * row_size];
+    TScalar max_value = min_value;
+    for (int j = extent[2]; j <= extent[3]; j++)
+    {
+      const TScalar *row = slice + (j - whole[2]) * row_size;
+      for (int i = 0; i <= extent[1] - extent[0]; i++)
+      {
+        min_value = std::min(min_value, row[i]);
+        max_value = std::max(max_value, row[i]);
+      }
+    }
+    low[s] = double(min_value);
+    high[s] = double(max_value);
+  });
+
+  range[0] = *std::min_element(low.begin(), low.end());
+  range[1] = *std::max_element(high.begin(), high.end());
+}
+
+// Scalar range of the voxels within bounds (and a margin of one voxel, as sampled), not of the whole image:
+// vtkImageData::GetScalarRange would read every page of a mapped volume.
+void GetBoundsScalarRange(vtkImageData *image, const double bounds[6], int n_threads, double range[2])
+{
+  int extent[6];
+  GetBoundsExtent(image, bounds, 1, extent);
+  if (image->GetNumberOfScalarComponents() != 1)
+  {
+    image->GetScalarRange(range);
+    return;
+  }
+
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(GetExtentScalarRangeTyped<VTK_TT>(image, extent, n_threads, range));
+  default:
+    image->GetScalarRange(range);
+  }
+}
+
 std::map<int, vtkSmartPointer<vtkPolyData>> CreateStack(vtkPolyData *master_slice, int n_slices, std::vector<float> direction, float dist_slices)
 {
   std::map<int, vtkSmartPointer<vtkPolyData>> stack;
 
-  time_t time_0;
-  time(&time_0);
-
   vtkMath::MultiplyScalar(direction.data(), dist_slices);
   int slice_id = 0;
 
@@ -49,49 +137,191 @@ std::map<int, vtkSmartPointer<vtkPolyData>> CreateStack(vtkPolyData *master_slic
     stack[slice_id] = ShiftMasterSlice(master_slice, s, direction);
   }
 
-  time_t time_1;
-  time(&time_1);
+  return stack;
+}
+
+// Shift of each slice of CreateStack, as xyz triplets
+std::vector<double> GetStackOffsets(int n_slices, std::vector<float> direction, float dist_slices)
+{
+  std::vector<double> offsets;
+
+  vtkMath::MultiplyScalar(direction.data(), dist_slices);
+
+  if (n_slices == 1)
+  {
+    offsets = {0.0, 0.0, 0.0};
+    return offsets;
+  }
+
+  for (int s = -n_slices / 2; s < n_slices / 2; s++)
+  {
+    // same float arithmetic as ShiftMasterSlice
+    float offset[3] = {direction[0], direction[1], direction[2]};
+    vtkMath::MultiplyScalar(offset, float(s));
+    offsets.push_back(offset[0]);
+    offsets.push_back(offset[1]);
+    offsets.push_back(offset[2]);
+  }
+
+  return offsets;
+}
 
-  // std::cout << "CreateStack tooks : " << difftime(time_1, time_0) << " [s]" << std::endl;
+// Same slices as CreateStack, without building the shifted copies of the master slice
+ImplicitStack CreateImplicitStack(vtkPolyData *master_slice, int n_slices, std::vector<float> direction, float dist_slices)
+{
+  ImplicitStack stack;
+  stack.points = master_slice->GetPoints();
+  stack.offsets = GetStackOffsets(n_slices, direction, dist_slices);
 
   return stack;
 }
 
-std::map<int, vtkSmartPointer<vtkPolyData>> CreateAxialStack(vtkPolyData *spline, float side_length, int resolution, std::vector<float> &iop_axial, std::vector<float> &ipp_axial)
+// Samples spread evenly across a slab of thickness centered on the master slice, ends included
+std::vector<double> GetSlabOffsets(int n_samples, const std::vector<float> &direction, float thickness)
 {
-  std::map<int, vtkSmartPointer<vtkPolyData>> stack;
+  std::vector<double> offsets;
+  if (n_samples < 2)
+  {
+    return {0.0, 0.0, 0.0};
+  }
 
-  vtkSmartPointer<vtkPolyData> targetPlane = vtkSmartPointer<vtkPolyData>::New();
+  for (int s = 0; s < n_samples; s++)
+  {
+    double t = thickness * (double(s) / (n_samples - 1) - 0.5);
+    offsets.push_back(direction[0] * t);
+    offsets.push_back(direction[1] * t);
+    offsets.push_back(direction[2] * t);
+  }
+
+  return offsets;
+}
+
+// Slab of the master slice: its samples are the offsets of an implicit stack, reduced by SampleSlab
+ImplicitStack CreateSlab(vtkPolyData *master_slice, const std::vector<float> &direction, float thickness, int n_samples)
+{
+  ImplicitStack stack;
+  stack.points = master_slice->GetPoints();
+  stack.offsets = GetSlabOffsets(n_samples, direction, thickness);
+
+  return stack;
+}
+
+// One plane per spline segment, centered on its first point and normal to the segment
+AxialFrames CreateAxialFrames(vtkPolyData *spline, float side_length, int resolution)
+{
+  AxialFrames frames;
+  frames.resolution = resolution;
+  frames.spacing = double(side_length) / resolution;
+
+  int n_frames = std::max(int(spline->GetNumberOfPoints()) - 1, 0);
+  frames.basis.resize(9 * n_frames);
 
   double p0[3];
   double p1[3];
   double n[3];
 
-  for (int frame = 0; frame < spline->GetNumberOfPoints() - 1; frame++)
-  // for (int frame = 0; frame < spline->GetNumberOfPoints() - 1; frame += 20) //DEV
+  for (int frame = 0; frame < n_frames; frame++)
   {
     spline->GetPoint(frame, p0);
     spline->GetPoint(frame + 1, p1);
+    vtkMath::Subtract(p1, p0, n);
+
+    double *basis = &frames.basis[9 * frame];
+    GetAxialBasis(p0, n, side_length, basis, basis + 3, basis + 6);
+  }
+
+  CMPR_LOG(LOG_DEBUG, "axial slices : " << n_frames);
 
-    n[0] = p1[0] - p0[0];
-    n[1] = p1[1] - p0[1];
-    n[2] = p1[2] - p0[2];
+  return frames;
+}
+
+// Image orientation and position of each axial plane
+void GetAxialIOPIPP(const AxialFrames &frames, std::vector<float> &iop_axial, std::vector<float> &ipp_axial)
+{
+  for (size_t f = 0; f < frames.basis.size(); f += 9)
+  {
+    ipp_axial.insert(ipp_axial.end(), &frames.basis[f], &frames.basis[f + 3]);
+    iop_axial.insert(iop_axial.end(), &frames.basis[f + 3], &frames.basis[f + 9]);
+  }
+}
 
-    targetPlane = GetOrientedPlane(p0, n, side_length, resolution, iop_axial, ipp_axial);
-    stack[frame] = targetPlane;
+// Sample position (i, j) of an axial plane, in the vtkPlaneSource point order
+inline void GetAxialPoint(const double *basis, double spacing, int i, int j, double x[3])
+{
+  for (int a = 0; a < 3; a++)
+  {
+    x[a] = basis[a] + i * spacing * basis[3 + a] + j * spacing * basis[6 + a];
   }
+}
 
-  std::cout << "axial slices : " << stack.size() << std::endl;
+// World bounds of every sample of the stack and of the axial planes
+void GetSampleBounds(const ImplicitStack &stack, const AxialFrames &frames, double bounds[6])
+{
+  for (int a = 0; a < 3; a++)
+  {
+    bounds[2 * a] = std::numeric_limits<double>::max();
+    bounds[2 * a + 1] = -std::numeric_limits<double>::max();
+  }
 
-  return stack;
+  // master slice bounds, shifted by the extreme offsets
+  double slice_bounds[6];
+  stack.points->GetBounds(slice_bounds);
+  for (size_t o = 0; o < stack.offsets.size(); o += 3)
+  {
+    for (int a = 0; a < 3; a++)
+    {
+      bounds[2 * a] = std::min(bounds[2 * a], slice_bounds[2 * a] + stack.offsets[o + a]);
+      bounds[2 * a + 1] = std::max(bounds[2 * a + 1], slice_bounds[2 * a + 1] + stack.offsets[o + a]);
+    }
+  }
+
+  // the corners of each plane
+  double x[3];
+  for (size_t f = 0; f < frames.basis.size(); f += 9)
+  {
+    for (int corner = 0; corner < 4; corner++)
+    {
+      GetAxialPoint(&frames.basis[f], frames.spacing, (corner & 1) * frames.resolution, (corner >> 1) * frames.resolution, x);
+      for (int a = 0; a < 3; a++)
+      {
+        bounds[2 * a] = std::min(bounds[2 * a], x[a]);
+        bounds[2 * a + 1] = std::max(bounds[2 * a + 1], x[a]);
+      }
+    }
+  }
 }
 
-vtkSmartPointer<vtkPolyData> Squash(std::map<int, vtkSmartPointer<vtkPolyData>> stack_map, bool reverse)
+// All the axial planes as a single polydata, same points as the squashed plane sources
+vtkSmartPointer<vtkPolyData> AxialFramesToPolyData(const AxialFrames &frames)
 {
+  int side = frames.resolution + 1;
+  vtkIdType n_frames = frames.basis.size() / 9;
+
+  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+  points->SetNumberOfPoints(n_frames * side * side);
 
-  time_t time_0;
-  time(&time_0);
+  double x[3];
+  vtkIdType cnt = 0;
+  for (vtkIdType f = 0; f < n_frames; f++)
+  {
+    for (int j = 0; j < side; j++)
+    {
+      for (int i = 0; i < side; i++)
+      {
+        GetAxialPoint(&frames.basis[9 * f], frames.spacing, i, j, x);
+        points->SetPoint(cnt++, x);
+      }
+    }
+  }
+
+  vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+  polyData->SetPoints(points);
+
+  return polyData;
+}
 
+vtkSmartPointer<vtkPolyData> Squash(std::map<int, vtkSmartPointer<vtkPolyData>> stack_map, bool reverse)
+{
   //Append all the meshes to a single polydata
   vtkSmartPointer<vtkPolyData> squashed = vtkSmartPointer<vtkPolyData>::New();
   vtkSmartPointer<vtkAppendPolyData> appendFilter = vtkSmartPointer<vtkAppendPolyData>::New();
@@ -114,67 +344,88 @@ vtkSmartPointer<vtkPolyData> Squash(std::map<int, vtkSmartPointer<vtkPolyData>>
 
   appendFilter->Update();
 
-  time_t time_1;
-  time(&time_1);
-
-  // std::cout << "Squash tooks : " << difftime(time_1, time_0) << " [s]" << std::endl;
-
   return appendFilter->GetOutput();
 }
 
-std::vector<float> GetPixelValues(vtkDataSet *dataset, bool reverse)
+template <class TValue, class TPixel>
+void CastPixels(const TValue *values, vtkIdType n, TPixel *out, bool reverse, PixelStats *stats)
 {
-  std::vector<float> values;
-
-  if (reverse)
+  for (vtkIdType i = 0; i < n; i++)
   {
-    for (int i = dataset->GetNumberOfPoints(); i > 0; i--)
+    TPixel pixel = CastPixel<TPixel>(double(values[i]));
+    out[reverse ? n - 1 - i : i] = pixel;
+    if (stats)
     {
-      values.push_back(dataset->GetPointData()->GetArray("ImageFile")->GetTuple(i)[0]);
+      stats->Add(double(pixel));
     }
   }
-  else
+}
+
+template <class TPixel>
+void GetPixelValuesInto(vtkDataArray *array, TPixel *out, bool reverse, PixelStats *stats)
+{
+  switch (array->GetDataType())
   {
-    for (int j = 0; j < dataset->GetNumberOfPoints(); j++)
-    {
-      values.push_back(dataset->GetPointData()->GetArray("ImageFile")->GetTuple(j)[0]);
-    }
+    vtkTemplateMacro(CastPixels(static_cast<const VTK_TT *>(array->GetVoidPointer(0)), array->GetNumberOfTuples(), out, reverse, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported scalar type " << array->GetDataType());
   }
+}
 
-  std::cout << "array filled with " << values.size() << " elements. " << std::endl;
+// Probed values in the pixel type, read straight from the probe output array; their stats are accumulated
+// on the way when stats is given
+PixelBuffer GetPixelValues(vtkDataSet *dataset, int type, bool reverse, PixelStats *stats)
+{
+  vtkDataArray *array = dataset->GetPointData()->GetArray("ImageFile");
+  PixelBuffer values(type, array->GetNumberOfTuples());
+
+  switch (type)
+  {
+    vtkTemplateMacro(GetPixelValuesInto(array, values.GetPointer<VTK_TT>(), reverse, stats));
+  default:
+    CMPR_LOG(LOG_WARNING, "unsupported pixel type " << type);
+  }
+
+  CMPR_LOG(LOG_DEBUG, "array filled with " << values.size << " elements. ");
 
   return values;
 }
 
-std::vector<float> GetDimensions(std::map<int, vtkSmartPointer<vtkPolyData>> stack)
+template <class TPixel>
+void AddPixelStats(const TPixel *values, size_t n, PixelStats &stats)
 {
-  std::vector<float> dimensions;
-  // Assume squared slice
-  float plane_edge = floor(sqrt(stack[0]->GetNumberOfPoints()));
-  dimensions.push_back(plane_edge);
-  dimensions.push_back(plane_edge);
-  dimensions.push_back(stack.size());
-
-  return dimensions;
+  for (size_t v = 0; v < n; v++)
+  {
+    stats.Add(double(values[v]));
+  }
 }
 
-// float GetWindowWidth(vtkSmartPointer<vtkImageData> image)
-float GetWindowWidth(std::vector<float> values, float max_, float min_)
+// Stats of a whole buffer, for pixels that were not sampled in one go (centerline session)
+PixelStats GetPixelStats(const PixelBuffer &values, const double scalar_range[2])
 {
-  float max = min_;
-  float min = max_;
+  PixelStats stats(scalar_range[0], scalar_range[1]);
 
-  for (int v = 0; v < values.size(); v++)
+  switch (values.type)
   {
-    if (values[v] > max)
-    {
-      max = values[v];
-    }
-    if (values[v] < min)
-    {
-      min = values[v];
-    }
+    vtkTemplateMacro(AddPixelStats(values.GetPointer<VTK_TT>(), values.size, stats));
+  }
+
+  return stats;
+}
+
+// Window width and level of the pixels, from their stats only.
+// percentile 0: full range of the pixels (within the volume range), level at half the width, as always returned.
+// percentile p: [p, 100 - p] percentiles of the histogram, level at their middle, not stretched by a few metal
+// or contrast outliers.
+std::vector<float> GetWindowLevel(const PixelStats &stats, const double scalar_range[2], float percentile)
+{
+  if (percentile > 0.0f && percentile < 50.0f && stats.count > 0)
+  {
+    double low = stats.GetPercentile(percentile);
+    double high = stats.GetPercentile(100.0 - percentile);
+    return {float(high - low), float((high + low) / 2)};
   }
 
-  return max - min;
+  float width = float(std::max(stats.max, scalar_range[0]) - std::min(stats.min, scalar_range[1]));
+  return {width, width / 2};
 }
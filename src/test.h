@@ -11,4 +11,314 @@ bool test_alg(vtkPolyData *plane, vtkDataSet *curved_surf)
     }
   }
   return true;
-}
\ No newline at end of file
+}
+template <class TScalar>
+bool test_simd_typed(vtkImageData *image, vtkDataSet *surface, vtkDataArray *probed)
+{
+  ImageGrid<TScalar> grid = GetImageGrid<TScalar>(image);
+  int n = int(surface->GetNumberOfPoints());
+  std::vector<double> x(n), y(n), z(n), values(n);
+  double p[3];
+  for (int i = 0; i < n; i++)
+  {
+    surface->GetPoint(i, p);
+    x[i] = p[0];
+    y[i] = p[1];
+    z[i] = p[2];
+  }
+
+  // integral values may round the other way than the probe filter weights, the instruction sets may not differ at all
+  double tolerance = std::numeric_limits<TScalar>::is_integer ? 1.0 : 1e-4;
+  std::vector<double> scalar(n);
+  SampleTrilinearBatch(grid, x.data(), y.data(), z.data(), n, scalar.data(), SIMD_SCALAR);
+  bool ok = true;
+  for (int level = SIMD_SCALAR; level <= GetSimdLevel(); level++)
+  {
+    clock_t t0 = clock();
+    SampleTrilinearBatch(grid, x.data(), y.data(), z.data(), n, values.data(), level);
+    double ms = 1000.0 * (clock() - t0) / CLOCKS_PER_SEC;
+
+    int mismatches = 0;
+    int differences = 0;
+    for (int i = 0; i < n; i++)
+    {
+      double vp = probed->GetTuple(i)[0];
+      if (std::abs(values[i] - vp) > tolerance * std::max(1.0, std::abs(vp)))
+      {
+        mismatches++;
+      }
+      if (values[i] != scalar[i])
+      {
+        differences++;
+      }
+    }
+    std::cout << "simd level " << level << ": " << ms << " [ms], " << mismatches << " mismatches with the probe filter, "
+              << differences << " differences with the scalar level" << std::endl;
+    ok = ok && mismatches == 0 && differences == 0;
+  }
+  return ok;
+}
+
+// Compare the trilinear kernels of every supported instruction set with the probe filter on a surface (within
+// rounding) and with the scalar kernel (exactly)
+bool test_simd(vtkImageData *image, vtkPolyData *surface)
+{
+  vtkSmartPointer<vtkProbeFilter> probe = ProbeImage(image, surface);
+  vtkDataArray *probed = probe->GetOutput()->GetPointData()->GetArray("ImageFile");
+
+  switch (image->GetScalarType())
+  {
+    vtkTemplateMacro(return test_simd_typed<VTK_TT>(image, probe->GetOutput(), probed));
+  }
+  return false;
+}
+
+// Write an image as a raw nrrd, the header padded so that the data are aligned and mapped by ReadNrrd.
+// Returns the size of the header.
+size_t WriteTestNrrd(vtkImageData *image, const std::string &path)
+{
+  int *dims = image->GetDimensions();
+  double *spacing = image->GetSpacing();
+  double *origin = image->GetOrigin();
+  int one = 1;
+  bool little_endian = *reinterpret_cast<char *>(&one) == 1;
+
+  std::ostringstream header;
+  header << "NRRD0004\ntype: " << image->GetScalarTypeAsString() << "\ndimension: 3\nsizes: " << dims[0] << " "
+         << dims[1] << " " << dims[2] << "\nspacings: " << spacing[0] << " " << spacing[1] << " " << spacing[2]
+         << "\nspace origin: (" << origin[0] << "," << origin[1] << "," << origin[2] << ")\nendian: "
+         << (little_endian ? "little" : "big") << "\nencoding: raw\n";
+  std::string text = header.str();
+  text += "#" + std::string((8 - (text.size() + 3) % 8) % 8, ' ') + "\n\n";
+
+  std::ofstream file(path.c_str(), std::ios::binary);
+  if (!file)
+  {
+    throw std::runtime_error("cannot write " + path);
+  }
+  file.write(text.data(), std::streamsize(text.size()));
+  file.write(static_cast<const char *>(image->GetScalarPointer()),
+             std::streamsize(vtkIdType(dims[0]) * dims[1] * dims[2] * image->GetScalarSize()));
+  return text.size();
+}
+
+// Straightened cmpr of a raw nrrd loaded as compute_cmpr_straight does (load_roi): no page of the file out of the
+// slices of the loaded extent may be read, eg. by a scan of the whole volume. The file is dropped from the page
+// cache before the request, then its resident pages are listed with mincore (Linux only).
+bool test_load_roi(vtkImageData *image, const std::string &path, int n_threads)
+{
+#ifdef __linux__
+  int *dims = image->GetDimensions();
+  double *spacing = image->GetSpacing();
+  size_t slice_bytes = size_t(dims[0]) * dims[1] * image->GetScalarSize();
+  WriteTestNrrd(image, path);
+  int fd = open(path.c_str(), O_RDONLY);
+  fsync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  // a centerline along z over the middle tenth of the volume
+  double bounds[6];
+  image->GetBounds(bounds);
+  std::vector<float> seeds;
+  for (int p = 0; p < 50; p++)
+  {
+    seeds.push_back(float((bounds[0] + bounds[1]) / 2));
+    seeds.push_back(float((bounds[2] + bounds[3]) / 2));
+    seeds.push_back(float(bounds[4] + (0.45 + 0.1 * p / 49) * (bounds[5] - bounds[4])));
+  }
+  std::vector<float> ptn = GetSyntheticNormals(seeds);
+  float slice_dimension = float(0.4 * std::min(bounds[1] - bounds[0], bounds[3] - bounds[2]));
+
+  vtkSmartPointer<vtkImageData> information = ReadNrrdInformation(path);
+  std::shared_ptr<MappedFile> mapping;
+  int extent[6];
+  VolumeLoader load = [&](const double sample_bounds[6]) {
+    GetBoundsExtent(information, sample_bounds, 1, extent);
+    return ReadNrrd(path, mapping, n_threads, extent);
+  };
+  CmprOptions options;
+  options.threads = n_threads;
+  ComputeCmprStraight(load, GetMetadata(information), nullptr, seeds, ptn, ptn, 128, {1, 0, 0}, {0.0f, 0.0f, 1.0f},
+                      slice_dimension, float(spacing[2]), 1, false, options);
+  if (!mapping)
+  {
+    std::cout << "load_roi: " << path << " not mapped" << std::endl;
+    std::remove(path.c_str());
+    return false;
+  }
+
+  // pages read ahead of the header and around the extent are allowed
+  size_t page = size_t(sysconf(_SC_PAGESIZE));
+  size_t slack = size_t(4) << 20;
+  size_t offset = mapping->GetSize() - slice_bytes * dims[2];
+  size_t begin = offset + extent[4] * slice_bytes;
+  size_t end = offset + (extent[5] + 1) * slice_bytes + slack;
+  begin = begin > slack ? begin - slack : 0;
+  std::vector<unsigned char> resident((mapping->GetSize() + page - 1) / page);
+  mincore(const_cast<unsigned char *>(mapping->GetData()), mapping->GetSize(), resident.data());
+
+  int outside = 0;
+  for (size_t p = 0; p < resident.size(); p++)
+  {
+    if ((resident[p] & 1) && p * page >= slack && ((p + 1) * page <= begin || p * page >= end))
+    {
+      outside++;
+    }
+  }
+  std::cout << "load_roi: slices " << extent[4] << "-" << extent[5] << " of " << dims[2] << ", " << outside
+            << " pages read out of them" << std::endl;
+
+  mapping.reset();
+  std::remove(path.c_str());
+  return outside == 0 && (extent[4] > 0 || extent[5] < dims[2] - 1);
+#else
+  std::cout << "load_roi: not checked on this platform" << std::endl;
+  return true;
+#endif
+}
+
+// Centerline edit: the last seeds move, only the rows and axial frames they moved are resampled, and the pixels
+// are the same as those of a new session on the edited centerline, also after an edit cancelled midway
+bool test_centerline_edit(vtkImageData *image, const std::vector<float> &seeds, unsigned int resolution,
+                          const std::string &path, int n_threads)
+{
+  WriteTestNrrd(image, path);
+  bool ok;
+  {
+    std::shared_ptr<Volume> volume = std::make_shared<Volume>(path);
+    CmprOptions options;
+    options.threads = n_threads;
+    std::vector<float> stack_direction = {0.0f, 0.0f, 1.0f};
+    double bounds[6];
+    image->GetBounds(bounds);
+    float slice_dimension = float(0.4 * std::min(bounds[1] - bounds[0], bounds[3] - bounds[2]));
+    float dist_slices = float(image->GetSpacing()[2]);
+    int n_slices = 4;
+
+    std::vector<float> edited = seeds;
+    for (size_t p = edited.size() / 3 - 5; p < edited.size() / 3; p++)
+    {
+      edited[3 * p] += 1.5f;
+      edited[3 * p + 1] -= 1.0f;
+    }
+    std::vector<float> ptn = GetSyntheticNormals(seeds);
+    std::vector<float> edited_ptn = GetSyntheticNormals(edited);
+
+    Centerline session(volume, seeds, resolution, 120.0f, options);
+    session.straight(seeds, ptn, ptn, stack_direction, slice_dimension, dist_slices, n_slices, nullptr);
+    CmprResult incremental = session.straight(edited, edited_ptn, edited_ptn, stack_direction, slice_dimension, dist_slices, n_slices, nullptr);
+    Centerline fresh(volume, edited, resolution, 120.0f, options);
+    CmprResult full = fresh.straight(edited, edited_ptn, edited_ptn, stack_direction, slice_dimension, dist_slices, n_slices, nullptr);
+
+    int rows = int(seeds.size() / 3) - 1;
+    float resampled_rows = incremental.fields["resampled"][0];
+    float resampled_frames = incremental.fields["resampled"][1];
+    bool same_cmpr = incremental.pixels_cmpr.bytes == full.pixels_cmpr.bytes;
+    bool same_axial = incremental.pixels_axial.bytes == full.pixels_axial.bytes;
+    std::cout << "centerline edit: " << resampled_rows << "/" << rows << " rows, " << resampled_frames
+              << " axial frames resampled, cmpr " << (same_cmpr ? "equal" : "different") << ", axial "
+              << (same_axial ? "equal" : "different") << " to a new session" << std::endl;
+    ok = same_cmpr && same_axial && resampled_rows > 0 && resampled_rows < rows;
+
+    // an edit cancelled at any point leaves a session whose next edit still matches
+    std::vector<float> other = seeds;
+    for (size_t p = 0; p < 5; p++)
+    {
+      other[3 * p + 2] += 2.0f;
+    }
+    std::shared_ptr<CancelToken> token = std::make_shared<CancelToken>();
+    std::thread canceller([token] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      token->Cancel();
+    });
+    try
+    {
+      std::vector<float> other_ptn = GetSyntheticNormals(other);
+      session.straight(other, other_ptn, other_ptn, stack_direction, slice_dimension, dist_slices, n_slices, token);
+    }
+    catch (const CmprCancelled &)
+    {
+    }
+    canceller.join();
+    CmprResult after_cancel = session.straight(edited, edited_ptn, edited_ptn, stack_direction, slice_dimension, dist_slices, n_slices, nullptr);
+    bool same_after_cancel = after_cancel.pixels_cmpr.bytes == full.pixels_cmpr.bytes &&
+                             after_cancel.pixels_axial.bytes == full.pixels_axial.bytes;
+    std::cout << "centerline edit after a cancelled edit: " << after_cancel.fields["resampled"][0] << "/" << rows
+              << " rows resampled, " << (same_after_cancel ? "equal" : "different") << " to a new session" << std::endl;
+    ok = ok && same_after_cancel;
+  }
+  std::remove(path.c_str());
+  return ok;
+}
+
+// Round trip of n points of a response through its mapping: pixels -> world -> pixels -> world, the two world points
+// within a hundredth of a pixel. Prints the time of the reverse mapping per point.
+bool test_mapping_round_trip(const CmprResult &result, bool axial, int n)
+{
+  const std::vector<float> &dimension = result.fields.at(axial ? "dimension_axial" : "dimension_cmpr");
+  const std::vector<float> &spacing = result.fields.at(axial ? "spacing_axial" : "spacing_cmpr");
+  double tolerance = 0.01 * std::min(spacing[0], spacing[1]);
+
+  // evenly spread fractional pixels, [image, row, col] or [frame, row, col] within the response
+  std::vector<double> pixels(3 * n);
+  for (int p = 0; p < n; p++)
+  {
+    double r[3] = {std::fmod(0.7548777 * p, 1.0), std::fmod(0.5698403 * p, 1.0), std::fmod(0.6180340 * p, 1.0)};
+    pixels[3 * p] = axial ? r[0] * (dimension[2] - 1) : std::floor(r[0] * dimension[2]);
+    pixels[3 * p + 1] = r[1] * (dimension[0] - 1);
+    pixels[3 * p + 2] = r[2] * (dimension[1] - 1);
+  }
+
+  const CmprMapping &mapping = *result.mapping;
+  std::vector<double> world = axial ? mapping.AxialToWorld(pixels.data(), n) : mapping.CmprToWorld(pixels.data(), n);
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  std::vector<double> back = axial ? mapping.WorldToAxial(world.data(), n) : mapping.WorldToCmpr(world.data(), n);
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+  std::vector<double> again = axial ? mapping.AxialToWorld(back.data(), n) : mapping.CmprToWorld(back.data(), n);
+
+  double max_error = 0.0;
+  int mismatches = 0;
+  for (int p = 0; p < n; p++)
+  {
+    double error = std::sqrt(vtkMath::Distance2BetweenPoints(&world[3 * p], &again[3 * p]));
+    max_error = std::max(max_error, error);
+    if (!(error <= tolerance))
+    {
+      mismatches++;
+    }
+  }
+  std::cout << (axial ? "  axial: " : "  cmpr: ") << n << " points in " << ms << " [ms] (" << 1000.0 * ms / n
+            << " [us] per point), max error " << max_error << " [mm], " << mismatches << " over " << tolerance
+            << " [mm]" << std::endl;
+  // a point is mapped well under a millisecond
+  return mismatches == 0 && ms / n < 0.1;
+}
+
+// Round trips of the cmpr and axial pixels of a straight stack and of a rotational cmpr through WorldToCmpr and
+// WorldToAxial. Where the centerline bends more than the cmpr is wide, far rows cross and a world point lies on
+// several of them: any of them is a valid answer, hence the comparison in world space.
+bool test_mapping(vtkImageData *image, const std::vector<float> &seeds, unsigned int resolution, int n_threads)
+{
+  VolumeLoader load = [image](const double *) { return image; };
+  CmprOptions options;
+  options.threads = n_threads;
+  std::vector<float> ptn = GetSyntheticNormals(seeds);
+  double bounds[6];
+  image->GetBounds(bounds);
+  float slice_dimension = float(0.4 * std::min(bounds[1] - bounds[0], bounds[3] - bounds[2]));
+  const int n = 4000;
+
+  CmprResult straight = ComputeCmprStraight(load, GetMetadata(image), nullptr, seeds, ptn, ptn, resolution, {1, 0, 0},
+                                            {0.0f, 0.0f, 1.0f}, slice_dimension, float(image->GetSpacing()[2]), 4,
+                                            false, options);
+  std::cout << "mapping, straight stack:" << std::endl;
+  bool ok = test_mapping_round_trip(straight, false, n);
+  ok = test_mapping_round_trip(straight, true, n) && ok;
+
+  CmprResult rotational = ComputeCmprRotational(load, GetMetadata(image), nullptr, seeds, ptn, ptn, resolution, {1, 0, 0},
+                                                slice_dimension, 8, options);
+  std::cout << "mapping, rotational:" << std::endl;
+  ok = test_mapping_round_trip(rotational, false, n) && ok;
+  return ok;
+}
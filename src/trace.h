@@ -0,0 +1,202 @@
+// Console messages: warnings are always printed, progress from verbosity 1, details of every stage from 2
+enum LogLevel
+{
+  LOG_WARNING = 0,
+  LOG_INFO = 1,
+  LOG_DEBUG = 2
+};
+
+std::atomic<int> &GetVerbosityLevel()
+{
+  static std::atomic<int> level(LOG_WARNING);
+  return level;
+}
+
+void SetVerbosity(int level)
+{
+  GetVerbosityLevel() = level;
+}
+
+// message is a stream expression, only evaluated at the requested verbosity: CMPR_LOG(LOG_DEBUG, "rows: " << rows)
+#define CMPR_LOG(level, message)            \
+  do                                        \
+  {                                         \
+    if (GetVerbosityLevel() >= (level))     \
+    {                                       \
+      std::cout << message << std::endl;    \
+    }                                       \
+  } while (0)
+
+// Reset the peak resident memory of the process to its current resident memory, so that the next peak read is
+// the peak since this call. Only Linux can (clear_refs), false elsewhere: the peak is then the process peak.
+bool ResetPeakMemory()
+{
+#if defined(__linux__)
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  return bool(clear_refs << "5" << std::flush);
+#else
+  return false;
+#endif
+}
+
+// Resident memory of the process and its peak, in MB (0 where not available). The peak is the one since the last
+// ResetPeakMemory on Linux, since the process start elsewhere.
+void GetProcessMemory(double &rss_mb, double &peak_rss_mb)
+{
+  rss_mb = 0.0;
+  peak_rss_mb = 0.0;
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+  {
+    rss_mb = counters.WorkingSetSize / 1048576.0;
+    peak_rss_mb = counters.PeakWorkingSetSize / 1048576.0;
+  }
+#elif defined(__APPLE__)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+  {
+    peak_rss_mb = usage.ru_maxrss / 1048576.0; // bytes
+  }
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) == KERN_SUCCESS)
+  {
+    rss_mb = info.resident_size / 1048576.0;
+  }
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+  {
+    peak_rss_mb = usage.ru_maxrss / 1024.0; // KiB
+  }
+  // VmHWM follows clear_refs resets, unlike ru_maxrss
+  std::ifstream status("/proc/self/status");
+  std::string field;
+  double kib;
+  while (status >> field)
+  {
+    if (field == "VmHWM:" && status >> kib)
+    {
+      peak_rss_mb = kib / 1024.0;
+    }
+    else if (field == "VmRSS:" && status >> kib)
+    {
+      rss_mb = kib / 1024.0;
+    }
+  }
+#endif
+}
+
+// One timed stage of a cmpr request
+struct StageTiming
+{
+  std::string stage;
+  double start_us;         // from the start of the request
+  double duration_us;
+  double rss_mb;           // resident memory at the end of the stage
+  double peak_rss_mb;      // stage_peak: peak resident memory during the stage, else of the process over a longer span
+  bool stage_peak = false; // no other stage was timed meanwhile, on a platform resetting the peak (Linux)
+  int track = 1;           // trace row, one per centerline in a batch
+};
+
+// The peak resident memory is process wide: it is only reset when a stage starts while no other stage is timed
+// (batch branches, previews and async requests run concurrently), and a stage reports it as its own only if no
+// other stage started before it ended
+struct PeakMemoryTracking
+{
+  std::mutex mutex;
+  int active = 0;       // stages being timed
+  long long starts = 0; // stages started so far
+};
+
+PeakMemoryTracking &GetPeakMemoryTracking()
+{
+  static PeakMemoryTracking tracking;
+  return tracking;
+}
+
+// Times the consecutive stages of a request on the steady clock: Start closes the running stage and opens the next
+class StageTimer
+{
+public:
+  StageTimer() : origin(std::chrono::steady_clock::now()), running(false) {}
+
+  ~StageTimer()
+  {
+    Stop();
+  }
+
+  void Start(const std::string &stage)
+  {
+    Stop();
+    current = stage;
+    {
+      PeakMemoryTracking &tracking = GetPeakMemoryTracking();
+      std::lock_guard<std::mutex> lock(tracking.mutex);
+      tracking.active++;
+      start_count = ++tracking.starts;
+      alone = tracking.active == 1 && ResetPeakMemory();
+    }
+    start = std::chrono::steady_clock::now();
+    running = true;
+  }
+
+  void Stop()
+  {
+    if (!running)
+    {
+      return;
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    StageTiming timing;
+    timing.stage = current;
+    timing.start_us = std::chrono::duration<double, std::micro>(start - origin).count();
+    timing.duration_us = std::chrono::duration<double, std::micro>(end - start).count();
+    {
+      PeakMemoryTracking &tracking = GetPeakMemoryTracking();
+      std::lock_guard<std::mutex> lock(tracking.mutex);
+      GetProcessMemory(timing.rss_mb, timing.peak_rss_mb);
+      timing.stage_peak = alone && tracking.starts == start_count;
+      tracking.active--;
+    }
+    stages.push_back(timing);
+    running = false;
+  }
+
+  double GetElapsedUs()
+  {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  std::vector<StageTiming> stages;
+
+private:
+  std::chrono::steady_clock::time_point origin;
+  std::chrono::steady_clock::time_point start;
+  std::string current;
+  bool running;
+  long long start_count; // stages started when this one did
+  bool alone;            // the peak was reset when this stage started
+};
+
+// Write the stages as a Chrome trace (chrome://tracing or ui.perfetto.dev), one complete event per stage
+void WriteChromeTrace(const std::string &path, const std::vector<StageTiming> &stages)
+{
+  std::ofstream file(path.c_str());
+  if (!file)
+  {
+    CMPR_LOG(LOG_WARNING, "cannot write trace " << path);
+    return;
+  }
+
+  file << "{\"traceEvents\": [";
+  for (size_t s = 0; s < stages.size(); s++)
+  {
+    file << (s > 0 ? ",\n" : "\n") << "  {\"name\": \"" << stages[s].stage << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << stages[s].track
+         << ", \"ts\": " << stages[s].start_us << ", \"dur\": " << stages[s].duration_us
+         << ", \"args\": {\"rss_mb\": " << stages[s].rss_mb << ", \"peak_rss_mb\": " << stages[s].peak_rss_mb
+         << ", \"stage_peak\": " << (stages[s].stage_peak ? "true" : "false") << "}}";
+  }
+  file << "\n]}\n";
+}
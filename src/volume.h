@@ -0,0 +1,148 @@
+// Volume session: the nrrd serie is read and decoded once, then reused by every cmpr request
+class Volume
+{
+public:
+  // bricked: also keep the scalars in bricks of 8^3 samples, faster to sample along curved surfaces
+  // on large volumes at the cost of a second copy of the scalars
+  // pyramid: build the mip levels used by previews now rather than on the first preview (1/7 more memory)
+  Volume(std::string volumeFileName, bool bricked = false, bool pyramid = false)
+  {
+    CMPR_LOG(LOG_INFO, "InputVolume: " << volumeFileName);
+
+    // Map the volume data (raw nrrd) or read it: a mapped volume is not read here, its pages
+    // are loaded on first access and shared with every process mapping the same file.
+    // Gzip nrrd written by compress_nrrd are inflated on all cores.
+    image = ReadNrrd(volumeFileName, mapping, 0, nullptr);
+    metadata = GetMetadata(image);
+
+    if (bricked)
+    {
+      BrickImage(image, 0);
+    }
+    if (pyramid)
+    {
+      GetPyramid();
+    }
+  }
+
+  // Scalar range of the volume, computed on first use since it scans every sample
+  const double *GetScalarRange()
+  {
+    std::call_once(scalar_range_once, [this] { image->GetScalarRange(scalar_range); });
+    return scalar_range;
+  }
+
+  // Mip levels of the volume, level 0 is the volume itself, built on first use
+  const std::vector<vtkSmartPointer<vtkImageData>> &GetPyramid()
+  {
+    std::call_once(pyramid_once, [this] { levels = CreatePyramid(image, 0); });
+    return levels;
+  }
+
+  CmprResult straight(std::vector<float> seeds,
+                      std::vector<float> tng,
+                      std::vector<float> ptn,
+                      unsigned int resolution,
+                      std::vector<int> dir,
+                      std::vector<float> stack_direction,
+                      float slice_dimension,
+                      float dist_slices,
+                      int n_slices,
+                      bool render,
+                      const CmprOptions &options)
+  {
+    CancelScope cancel_scope(options.cancel); // also covers the pyramid built for the first preview
+    if (options.on_preview)
+    {
+      unsigned int preview_resolution = std::max(std::min(resolution, options.preview_resolution), 1u);
+      int level = GetPyramidLevel(GetPyramid(), slice_dimension / preview_resolution);
+      vtkImageData *preview_image = GetPyramid()[level];
+      CmprOptions preview_options = GetPreviewOptions(options);
+      ScaleViewportCols(preview_options.viewport, float(preview_resolution) / resolution);
+      CmprResult preview = ComputeCmprStraight([preview_image](const double *) { return preview_image; }, metadata, GetScalarRange(),
+                                               seeds, tng, ptn, preview_resolution, dir, stack_direction, slice_dimension,
+                                               dist_slices, n_slices, false, preview_options);
+      preview.fields["pyramid_level"] = {float(level)};
+      options.on_preview(std::move(preview));
+    }
+
+    return ComputeCmprStraight([this](const double *) { return image; }, metadata, GetScalarRange(), seeds, tng, ptn, resolution, dir,
+                               stack_direction, slice_dimension, dist_slices, n_slices, render, options);
+  }
+
+  CmprResult stretch(std::vector<float> seeds,
+                     unsigned int resolution,
+                     std::vector<int> dir,
+                     std::vector<float> stack_direction,
+                     float dist_slices,
+                     int n_slices,
+                     bool render,
+                     const CmprOptions &options)
+  {
+    CancelScope cancel_scope(options.cancel);
+    if (options.on_preview)
+    {
+      unsigned int preview_resolution = std::max(std::min(resolution, options.preview_resolution), 1u);
+      double direction[3] = {double(dir[0]), double(dir[1]), double(dir[2])};
+      int level = GetPyramidLevel(GetPyramid(), GetStretchDistance(metadata, direction) / preview_resolution);
+      vtkImageData *preview_image = GetPyramid()[level];
+      CmprResult preview = ComputeCmprStretch([preview_image](const double *) { return preview_image; }, metadata, GetScalarRange(),
+                                              seeds, preview_resolution, dir, stack_direction, dist_slices, n_slices, false,
+                                              GetPreviewOptions(options));
+      preview.fields["pyramid_level"] = {float(level)};
+      options.on_preview(std::move(preview));
+    }
+
+    return ComputeCmprStretch([this](const double *) { return image; }, metadata, GetScalarRange(), seeds, resolution, dir,
+                              stack_direction, dist_slices, n_slices, render, options);
+  }
+
+  // Straightened cmpr from n_angles view angles over [0, 180) degrees, angles x rows x cols
+  CmprResult rotational(std::vector<float> seeds,
+                        std::vector<float> tng,
+                        std::vector<float> ptn,
+                        unsigned int resolution,
+                        std::vector<int> dir,
+                        float slice_dimension,
+                        int n_angles,
+                        const CmprOptions &options)
+  {
+    return ComputeCmprRotational([this](const double *) { return image; }, metadata, GetScalarRange(), seeds, tng, ptn, resolution, dir,
+                                 slice_dimension, n_angles, options);
+  }
+
+  // Straightened cmprs of several centerlines (eg. a vessel tree), sampled together on the worker pool
+  std::vector<CmprResult> straight_batch(std::vector<CenterlineSpec> specs, const CmprOptions &options)
+  {
+    return ComputeCmprStraightBatch(image, metadata, GetScalarRange(), specs, options);
+  }
+
+  // Declared before the image: the mapped data outlives the scalars pointing into it
+  std::shared_ptr<MappedFile> mapping;
+  vtkSmartPointer<vtkImageData> image;
+  std::vector<float> metadata;
+
+private:
+  // The preview itself has no preview and no trace of its own
+  static CmprOptions GetPreviewOptions(const CmprOptions &options)
+  {
+    CmprOptions preview_options = options;
+    preview_options.on_preview = nullptr;
+    preview_options.trace_file.clear();
+    return preview_options;
+  }
+
+  // Viewport of a cmpr with scale times its columns (eg. the preview), its output as coarse
+  static void ScaleViewportCols(CmprViewport &viewport, float scale)
+  {
+    viewport.col_begin *= scale;
+    viewport.col_end *= scale;
+    viewport.out_rows = viewport.out_rows > 0 ? std::max(unsigned(std::ceil(viewport.out_rows * scale)), 1u) : 0;
+    viewport.out_cols = viewport.out_cols > 0 ? std::max(unsigned(std::ceil(viewport.out_cols * scale)), 1u) : 0;
+  }
+
+  std::once_flag scalar_range_once;
+  double scalar_range[2];
+  std::once_flag pyramid_once;
+  std::vector<vtkSmartPointer<vtkImageData>> levels;
+};